@@ -1,6 +1,9 @@
 #include "compact.h"
 #include "compact_internal.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #if RMALLOC_DEBUG
 #include <stdio.h>
 #endif
@@ -81,13 +84,32 @@ static uint64_t uptime_nanoseconds(void)
 #include "compact_debug.c"
 #endif
 
+#include "compact_stats.c"
+#include "compact_trace.c"
+
 #if RMALLOC_DEBUG > 1
 #define fprintf(...) 
 #define fputc(...)
 #endif
 
 
-static rmalloc_meta_t *g_state = NULL;
+/* the heap of rm_init() and rm_set_state(), for all threads. during an
+ * rm_arena_*() call, the calling thread uses the arena's instead, so that
+ * arenas on different threads, and the global heap, don't get in each
+ * other's way.
+ */
+static rmalloc_meta_t *g_heap_state = NULL;
+
+#ifndef __BILLY__
+static __thread rmalloc_meta_t *t_arena_state = NULL;
+
+#define g_state (t_arena_state != NULL ? t_arena_state : g_heap_state)
+#define WITH_ARENA(arena, body...) {rmalloc_meta_t *saved_state = t_arena_state; t_arena_state = &(arena)->state; body; t_arena_state = saved_state;}
+#else
+// single-threaded
+#define g_state g_heap_state
+#define WITH_ARENA(arena, body...) {rmalloc_meta_t *saved_state = g_heap_state; g_heap_state = &(arena)->state; body; g_heap_state = saved_state;}
+#endif
 
 
 // code
@@ -195,6 +217,8 @@ bool rm_header_is_unused(rm_header_t *header) {
 static void header_clear(rm_header_t *h) {
     h->memory = NULL;
     h->size = 0;
+    h->lock_count = 0;
+    h->move_cb = 0;
     h->next = NULL;
 #if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
     h->next_unused = NULL;
@@ -202,18 +226,65 @@ static void header_clear(rm_header_t *h) {
 }
 
 
+#if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
+/* the unused headers are kept in a skew heap, highest address first, so the
+ * headers nearest header_top are reused first and the table can shrink from
+ * the bottom, see header_trim(). an unused header's next_unused is its left
+ * child, and its size the index of its right child, 0 if none. next is left
+ * alone, the header list mustn't be touched.
+ */
+static rm_header_t *unused_right(rm_header_t *h) {
+    return h->size != 0 ? g_state->header_top - h->size : NULL;
+}
+
+
+static void unused_set_right(rm_header_t *h, rm_header_t *right) {
+    h->size = right != NULL ? g_state->header_top - right : 0;
+}
+
+
+static rm_header_t *unused_meld(rm_header_t *a, rm_header_t *b) {
+    rm_header_t *root = NULL, **link = &root;
+    while (a != NULL && b != NULL) {
+        if (a < b) {
+            rm_header_t *t = a;
+            a = b;
+            b = t;
+        }
+        // a's right subtree melded with b becomes its left, and its left
+        // its right
+        *link = a;
+        rm_header_t *right = unused_right(a);
+        unused_set_right(a, a->next_unused);
+        link = &a->next_unused;
+        a = right;
+    }
+    *link = a != NULL ? a : b;
+    return root;
+}
+
+
+/* the unused headers from header_bottom and up, as one chain down the left */
+static void unused_rebuild(void) {
+    rm_header_t **link = &g_state->unused_header_root;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (rm_header_is_unused(h)) {
+            h->size = 0;
+            *link = h;
+            link = &h->next_unused;
+        }
+    }
+    *link = NULL;
+}
+#endif
+
+
 static rm_header_t *header_set_unused(rm_header_t *header) {
 
     header_clear(header);
 
 #if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
-    if (g_state->unused_header_root == NULL) {
-        g_state->unused_header_root = header;
-    } else {
-        header->next_unused = g_state->unused_header_root;
-        g_state->unused_header_root = header;
-    }
-    g_state->unused_header_root->next_unused = NULL;
+    g_state->unused_header_root = unused_meld(g_state->unused_header_root, header);
 #endif
 
 #if RMALLOC_DEBUG
@@ -223,17 +294,39 @@ static rm_header_t *header_set_unused(rm_header_t *header) {
     return header;
 }
 
+
+/* raise header_bottom past the unused headers at the bottom, and give their
+ * space to the blocks. the bytes given.
+ */
+static uint32_t header_trim(void) {
+    rm_header_t *bottom = g_state->header_bottom;
+    while (rm_header_is_unused(g_state->header_bottom) && g_state->header_bottom < g_state->header_top)
+        g_state->header_bottom++;
+    if (g_state->header_bottom == bottom)
+        return 0;
+
+#if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
+    // those below are about to be overwritten
+    unused_rebuild();
+#endif
+    return (g_state->header_bottom - bottom) * sizeof(rm_header_t);
+}
+
 rm_header_t *rm_header_find_free(void) {
     const int limit = 2; // for compact
     rm_header_t *h = NULL;
 
 #if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
-    if (g_state->unused_header_root != NULL) {
+    while (g_state->unused_header_root != NULL) {
         h = g_state->unused_header_root;
+        g_state->unused_header_root = unused_meld(h->next_unused, unused_right(h));
+        h->next_unused = NULL;
+        h->size = 0;
 
-        g_state->unused_header_root = g_state->unused_header_root->next_unused;
-
-        goto finish;
+        // rm_compact() may have raised header_bottom above it, in which case
+        // it's handed out below instead. don't hand it out twice.
+        if (h >= g_state->header_bottom)
+            goto finish;
     }
 #else
     h = g_header_top;
@@ -308,6 +401,7 @@ static void update_highest_address_if_needed(rm_header_t *h) {
 
 
 static rm_header_t *freeblock_find(uint32_t size);
+static rm_header_t *freeblock_find_placed(uint32_t size);
 
 
 static rm_header_t *block_new(uintptr_t size) {
@@ -326,6 +420,21 @@ static rm_header_t *block_new(uintptr_t size) {
 
     rm_header_t *h = NULL;
 
+    if (g_state->placement != RM_PLACEMENT_DEFAULT) {
+        h = freeblock_find_placed(size);
+        if (h != NULL) {
+            g_state->header_used_count++;
+            h->type = BLOCK_TYPE_UNLOCKED;
+            h->move_cb = 0;
+
+            g_state->free_block_hits++;
+            g_state->free_block_alloc += size;
+
+            update_highest_address_if_needed(h);
+            return h;
+        }
+    }
+
     // XXX: Is this really the proper fix?
     if ((uint8_t *)g_state->memory_top+size+sizeof(rm_header_t) < (uint8_t *)g_state->header_bottom) {
     //if ((uint8_t *)g_memory_top+size < (uint8_t *)g_header_bottom) {
@@ -348,6 +457,7 @@ static rm_header_t *block_new(uintptr_t size) {
         h->size = size;
         h->memory = g_state->memory_top;
         h->type = BLOCK_TYPE_UNLOCKED;
+        h->move_cb = 0;
 
         if ((uintptr_t)h->memory < (uintptr_t)g_state->memory_bottom)
             abort();
@@ -370,6 +480,7 @@ static rm_header_t *block_new(uintptr_t size) {
 
         g_state->header_used_count++;
         h->type = BLOCK_TYPE_UNLOCKED;
+        h->move_cb = 0;
 
         g_state->free_block_hits++;
         g_state->free_block_alloc += size;
@@ -381,6 +492,58 @@ static rm_header_t *block_new(uintptr_t size) {
 }
 
 
+/* tell the owner of a block with a relocation callback that it has moved */
+static void block_moved(rm_header_t *h, void *old_memory) {
+    if (h->move_cb != 0 && g_state->move_cbs[h->move_cb - 1] != NULL)
+        g_state->move_cbs[h->move_cb - 1]((rm_handle_t)h, old_memory, h->memory);
+}
+
+
+static bool compress_touch(rm_header_t *h);
+static void compress_forget(rm_header_t *h);
+static bool dedup_free(rm_header_t *h);
+static void index_forget(rm_header_t *h);
+static rm_handle_t malloc_with_cb(int size, rm_move_cb on_move, uint8_t tag);
+
+
+/* locks of an alias go to the header that has the block, see compact_dedup.c */
+static rm_header_t *header_owner(rm_header_t *h) {
+    return RMALLOC_DEDUP && h->type == BLOCK_TYPE_ALIAS ? h->next : h;
+}
+
+
+/* record every sample_every'th access, see rm_compact_locality(), and count
+ * the lock for the pinned zone, see compact_zone.c
+ */
+static void sample_access(rm_header_t *h) {
+    if (!RMALLOC_SAMPLING)
+        return;
+
+    uint32_t index = g_state->header_top - h;
+    if (index < g_state->lock_scores_count) {
+        uint8_t score = __atomic_load_n(&g_state->lock_scores[index], __ATOMIC_RELAXED);
+        if (score < 255)
+            __atomic_store_n(&g_state->lock_scores[index], score + 1, __ATOMIC_RELAXED);
+    }
+
+    uint32_t every = __atomic_load_n(&g_state->sample_every, __ATOMIC_ACQUIRE);
+    if (every == 0)
+        return;
+
+    if (!heap_concurrent()) {
+        if (++g_state->sample_counter % every == 0)
+            g_state->samples[g_state->sample_next++ % RM_SAMPLE_COUNT] = index;
+        return;
+    }
+
+    if (__atomic_add_fetch(&g_state->sample_counter, 1, __ATOMIC_RELAXED) % every != 0)
+        return;
+
+    uint32_t slot = __atomic_fetch_add(&g_state->sample_next, 1, __ATOMIC_RELAXED) % RM_SAMPLE_COUNT;
+    __atomic_store_n(&g_state->samples[slot], index, __ATOMIC_RELAXED);
+}
+
+
 /* 1. mark the block's header as free
  * 2. insert block info
  * 3. extend the free list
@@ -389,6 +552,8 @@ static rm_header_t *block_free(rm_header_t *header) {
     if (!header || header->type == BLOCK_TYPE_FREE)
         return header;
 
+    TRACE(RM_TRACE_FREE, header, header->memory, NULL, header->size);
+
 #if RMALLOC_DEBUG
     fprintf(stderr, "block free: 0x%X\n", header);
     freeblock_verify_lower_size();
@@ -928,6 +1093,73 @@ static rm_header_t *freeblock_find(uint32_t size) {
 }
 
 
+/* freeblock_find() for the placement policies other than the default.
+ *
+ * scans the slots that can hold a block of 'size', picks a block according
+ * to the policy and allocates from its low end. the rest keeps its header
+ * and free_memory_block_t, which is at the end. a rest too small for a free
+ * block goes with the allocation.
+ *
+ * input:  [                        block]
+ * output: [     block|              rest]
+ */
+static rm_header_t *freeblock_find_placed(uint32_t size) {
+    uint8_t placement = g_state->placement;
+    free_memory_block_t *found = NULL, *found_prev = NULL;
+    int found_k = 0;
+
+    for (int k = rm_log2(size); k < g_state->free_block_slot_count; k++) {
+        free_memory_block_t *prev = NULL;
+        for (free_memory_block_t *block = g_state->free_block_slots[k]; block != NULL; prev = block, block = block->next) {
+            if (block->header->size < size)
+                continue;
+
+            bool better = found == NULL
+                || (placement == RM_PLACEMENT_FIRST_FIT && block->header->memory < found->header->memory)
+                || (placement == RM_PLACEMENT_BEST_FIT && block->header->size < found->header->size);
+            if (better) {
+                found = block;
+                found_prev = prev;
+                found_k = k;
+            }
+            if (placement == RM_PLACEMENT_LOW)
+                break;
+        }
+
+        if (found != NULL && placement != RM_PLACEMENT_FIRST_FIT)
+            break;
+    }
+
+    if (found == NULL)
+        return NULL;
+
+    rm_header_t *free_header = found->header;
+    uint32_t rest = free_header->size - size;
+    rm_header_t *h = free_header;
+
+    if (rest >= sizeof(free_memory_block_t)) {
+        h = header_new(/*insert_in_list*/true);
+        if (h == NULL)
+            return NULL;
+
+        h->memory = free_header->memory;
+        h->size = size;
+        free_header->memory = (uint8_t *)free_header->memory + size;
+        free_header->size = rest;
+    }
+
+    if (found_prev == NULL)
+        g_state->free_block_slots[found_k] = found->next;
+    else
+        found_prev->next = found->next;
+
+    if (h != free_header)
+        freeblock_insert(found);
+
+    return h;
+}
+
+
 void rm_header_sort_all() {
 #if RMALLOC_DEBUG
     fprintf(stderr, "g_header_root before header_sort_all(): %p\n", g_header_root);
@@ -944,6 +1176,7 @@ static uint32_t /*size*/ get_free_header_range(rm_header_t *start, rm_header_t *
 
     while (start != NULL && start->type != BLOCK_TYPE_FREE)
     {
+        STATS_COMPACT_VISITED;
         start = start->next;
     }
 
@@ -965,6 +1198,7 @@ static uint32_t /*size*/ get_free_header_range(rm_header_t *start, rm_header_t *
         *last = start;
         size += start->size;
 
+        STATS_COMPACT_VISITED;
         start = start->next;
     }
 
@@ -986,6 +1220,7 @@ static uint32_t /*size*/ get_unlocked_header_range(rm_header_t *start, rm_header
             *passed_free_blocks = true;
         }
         *block_before_first = start;
+        STATS_COMPACT_VISITED;
         start = start->next;
     }
 
@@ -1022,6 +1257,7 @@ static uint32_t /*size*/ get_unlocked_header_range(rm_header_t *start, rm_header
 
             *block_before_first = start;
 
+            STATS_COMPACT_VISITED;
             start = start->next;
         }
 
@@ -1066,6 +1302,7 @@ static uint32_t /*size*/ get_unlocked_header_range(rm_header_t *start, rm_header
         *last = start;
         size += start->size;
 
+        STATS_COMPACT_VISITED;
         start = start->next;
     }
 
@@ -1093,6 +1330,7 @@ static rm_header_t *find_last_nonfree_header(rm_header_t *root) {
     while (root != NULL && root->type != BLOCK_TYPE_FREE)
     {
         last_nonfree = root;
+        STATS_COMPACT_VISITED;
         root = root->next;
     }
 
@@ -1161,12 +1399,7 @@ static void rebuild_free_block_slots() {
 }
 
 
-void rm_init(void *heap, uint32_t size) {
-    if ( g_state == NULL ) {
-        // in case the user hasn't set a state pointer, allocate a new state block
-        g_state = calloc(1, sizeof(rmalloc_meta_t));
-    }
-
+static void heap_init(void *heap, uint32_t size) {
     g_state->memory_size = size;
 
     // +1 to round up. e.g. log2(15)==3
@@ -1188,21 +1421,214 @@ void rm_init(void *heap, uint32_t size) {
     g_state->header_root->next = NULL;
     g_state->header_used_count = 0;
 
-    // newly unused headers are prepended, i.e. placed first, and g_unused_header_root is re-pointed.
+    // newly unused headers go into the heap at unused_header_root, see
+    // header_set_unused().
 #if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
     g_state->unused_header_root = NULL;
-    //g_unused_header_root->next_unused = NULL;
 #endif
 
     header_set_unused(g_state->header_top);
     g_state->header_top->size = 0;
+    // in the table too, and handed out by the scan in rm_header_find_free()
+    // with JEFF_MAX_RAM_VS_SLOWER_MALLOC. after rm_arena_reset() it may
+    // still hold an old block.
+    header_clear(g_state->header_bottom);
 
     g_state->highest_address_header = g_state->header_top; // to make sure it points to _something_
 
+    g_state->mapping = NULL;
+    g_state->mapping_size = 0;
+    g_state->placement = RM_PLACEMENT_DEFAULT;
+    memset(g_state->move_cbs, 0, sizeof(g_state->move_cbs));
+    g_state->oom_handler = NULL;
+    g_state->oom_arg = NULL;
+    g_state->to_space = NULL;
+    g_state->to_space_size = 0;
+    g_state->sample_every = 0;
+    g_state->sample_counter = 0;
+    g_state->sample_next = 0;
+    g_state->samples = NULL;
+    g_state->lock_scores = NULL;
+    g_state->lock_scores_count = 0;
+    g_state->zone_top = g_state->memory_bottom;
+    g_state->groups = NULL;
+    g_state->group_ids = NULL;
+    g_state->group_ids_count = 0;
+    g_state->compress_ages = NULL;
+    g_state->compress_ages_count = 0;
+    g_state->compress_cold_after = 0;
+    g_state->spill_fd = -1;
+    g_state->spill_cold_after = 0;
+    g_state->spill_end = 0;
+    g_state->spill_holes = NULL;
+    g_state->spill_hole_count = 0;
+    g_state->spill_hole_capacity = 0;
+    g_state->dedup_flags = NULL;
+    g_state->dedup_flags_count = 0;
+    g_state->dedup_pending = 0;
+    g_state->generations = NULL;
+    g_state->generations_count = 0;
+    g_state->tags = NULL;
+    g_state->tags_count = 0;
+    memset(g_state->tag_bytes, 0, sizeof(g_state->tag_bytes));
+    memset(g_state->tag_handles, 0, sizeof(g_state->tag_handles));
+    memset(g_state->tag_limits, 0, sizeof(g_state->tag_limits));
+    memset(g_state->tag_limit_cbs, 0, sizeof(g_state->tag_limit_cbs));
+    memset(g_state->tag_limit_args, 0, sizeof(g_state->tag_limit_args));
+    g_state->shared = false;
+    g_state->hugepage = false;
+    g_state->concurrent = false;
+}
+
+
+void rm_init(void *heap, uint32_t size) {
+    if ( g_state == NULL ) {
+        // in case the user hasn't set a state pointer, allocate a new state block
+        g_heap_state = calloc(1, sizeof(rmalloc_meta_t));
+    }
+
+    heap_init(heap, size);
+
     memset(heap, 0, size);
 }
 
 
+#include "compact_concurrent.c"
+#include "compact_file.c"
+#include "compact_hugepage.c"
+#include "compact_parallel.c"
+#include "compact_zone.c"
+#include "compact_group.c"
+#include "compact_tag.c"
+#include "compact_compress.c"
+#include "compact_spill.c"
+#include "compact_dedup.c"
+#include "compact_copying.c"
+#include "compact_trim.c"
+
+
+uint32_t rm_handle_index(rm_handle_t h) {
+    return g_state->header_top - (rm_header_t *)h;
+}
+
+
+rm_handle_t rm_handle_from_index(uint32_t index) {
+    return (rm_handle_t)(g_state->header_top - index);
+}
+
+
+/* 32-bit handles. the generations are a byte per handle index, bumped when
+ * the handle is freed.
+ */
+#if RM_INDEX_GENERATION_BITS < 1 || RM_INDEX_GENERATION_BITS > 8
+#error "RM_INDEX_GENERATION_BITS must be 1 to 8"
+#endif
+#define RM_INDEX_MASK ((1u << RM_INDEX_BITS) - 1)
+#define RM_GENERATION_MASK ((1u << RM_INDEX_GENERATION_BITS) - 1)
+
+static void index_forget(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    if (RMALLOC_GENERATIONS && index < g_state->generations_count)
+        __atomic_store_n(&g_state->generations[index], (uint8_t)(g_state->generations[index] + 1), __ATOMIC_RELAXED);
+}
+
+
+rm_index_t rm_index(rm_handle_t h) {
+    if (h == NULL)
+        return 0;
+    uint32_t index = g_state->header_top - (rm_header_t *)h;
+    if (index >= RM_INDEX_MASK)
+        return 0;
+
+    if (RMALLOC_GENERATIONS && g_state->generations == NULL && !g_state->shared && (g_state->mapping == NULL || g_state->hugepage)) {
+        if (heap_concurrent())
+            heap_mutex_lock();
+        if (g_state->generations == NULL) {
+            uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+            g_state->generations = (uint8_t *)calloc(count, 1);
+            if (g_state->generations != NULL)
+                g_state->generations_count = count;
+        }
+        if (heap_concurrent())
+            heap_mutex_unlock();
+    }
+
+    uint32_t generation = index < g_state->generations_count ? g_state->generations[index] : 0;
+    return ((generation & RM_GENERATION_MASK) << RM_INDEX_BITS) | (index + 1);
+}
+
+
+rm_handle_t rm_index_handle(rm_index_t i) {
+    // 0 wraps around, and is out of range
+    uint32_t index = (i & RM_INDEX_MASK) - 1;
+    if (index > (uint32_t)(g_state->header_top - g_state->header_bottom))
+        return NULL;
+
+    rm_header_t *h = g_state->header_top - index;
+    if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE)
+        return NULL;
+    if (index < g_state->generations_count) {
+        uint32_t generation = __atomic_load_n(&g_state->generations[index], __ATOMIC_RELAXED);
+        if (((generation ^ (i >> RM_INDEX_BITS)) & RM_GENERATION_MASK) != 0)
+            return NULL;
+    }
+    return (rm_handle_t)h;
+}
+
+
+void *rm_index_lock(rm_index_t i) {
+    rm_handle_t h = rm_index_handle(i);
+    return h != NULL ? rm_lock(h) : NULL;
+}
+
+
+void rm_index_unlock(rm_index_t i) {
+    rm_handle_t h = rm_index_handle(i);
+    if (h != NULL)
+        rm_unlock(h);
+}
+
+
+static void index_destroy(void) {
+    if (g_state == NULL)
+        return;
+
+    free(g_state->generations);
+    g_state->generations = NULL;
+    g_state->generations_count = 0;
+}
+
+
+void rm_set_sampling(uint32_t every) {
+    if (!RMALLOC_SAMPLING || g_state->shared)
+        return;
+
+    // the ring is set before sample_access() can see every != 0
+    if (every != 0 && g_state->samples == NULL) {
+        uint32_t *samples = (uint32_t *)calloc(RM_SAMPLE_COUNT, sizeof(uint32_t));
+        if (samples == NULL)
+            return;
+        __atomic_store_n(&g_state->samples, samples, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&g_state->sample_every, every, __ATOMIC_RELEASE);
+}
+
+
+static void sampling_destroy(void) {
+    if (g_state == NULL || g_state->shared)
+        return;
+
+    g_state->sample_every = 0;
+    free(g_state->samples);
+    g_state->samples = NULL;
+}
+
+
+void rm_set_placement(rm_placement_t placement) {
+    g_state->placement = placement;
+}
+
+
 size_t rm_state_size(void) {
     return sizeof(rmalloc_meta_t);
 }
@@ -1214,18 +1640,138 @@ rmalloc_meta_t* rm_get_state(void) {
 
 
 void rm_set_state(rmalloc_meta_t *state) {
-    g_state = state;
+    g_heap_state = state;
+}
+
+
+/* the tables and the spill file that heap_init() starts without */
+static void heap_tables_destroy(void) {
+    copying_destroy();
+    sampling_destroy();
+    zone_destroy();
+    group_destroy();
+    spill_destroy();
+    compress_destroy();
+    dedup_destroy();
+    index_destroy();
+    tag_destroy();
 }
 
 
 void rm_destroy() {
-    // nop.
-    return;
+    // nop, unless the heap is backed by a file or huge pages.
+    rm_compact_background_stop();
+    heap_tables_destroy();
+    if (g_state != NULL && g_state->hugepage)
+        hugepage_destroy();
+    else
+        file_destroy();
 }
 
 
-rm_handle_t rm_malloc(int size) {
-    rm_header_t *h = block_new(size);
+/* arenas
+ *
+ * each call switches to the arena's state and back, so the global heap (and
+ * any other arena) is left as it was.
+ */
+rm_arena_t *rm_arena_create(void *region, uint32_t size) {
+    if (size < sizeof(rm_arena_t) + RM_ARENA_MIN_HEAP_SIZE)
+        return NULL;
+
+    rm_arena_t *arena = (rm_arena_t *)region;
+    memset(arena, 0, sizeof(rm_arena_t));
+    arena->heap = arena + 1;
+    arena->size = size - sizeof(rm_arena_t);
+
+    WITH_ARENA(arena, rm_init(arena->heap, arena->size));
+
+    return arena;
+}
+
+
+/* drop all handles at once. the headers and the heap are left as they are,
+ * only the free slots are cleared and the top and bottom pointers reset.
+ * the tables by handle index are freed, their handles are gone.
+ */
+void rm_arena_reset(rm_arena_t *arena) {
+    WITH_ARENA(arena, heap_tables_destroy(); heap_init(arena->heap, arena->size));
+}
+
+
+rm_handle_t rm_arena_malloc(rm_arena_t *arena, int size) {
+    rm_handle_t h;
+    WITH_ARENA(arena, h = rm_malloc(size));
+    return h;
+}
+
+
+void rm_arena_free(rm_arena_t *arena, rm_handle_t h) {
+    WITH_ARENA(arena, rm_free(h));
+}
+
+
+void *rm_arena_lock(rm_arena_t *arena, rm_handle_t h) {
+    void *memory;
+    WITH_ARENA(arena, memory = rm_lock(h));
+    return memory;
+}
+
+
+void rm_arena_unlock(rm_arena_t *arena, rm_handle_t h) {
+    WITH_ARENA(arena, rm_unlock(h));
+}
+
+
+void rm_arena_compact(rm_arena_t *arena, uint32_t maxtime) {
+    WITH_ARENA(arena, rm_compact(maxtime));
+}
+
+
+/* 1 + index of the callback in g_state->move_cbs, registering it if needed.
+ * 0 if on_move is NULL, -1 if the table is full.
+ */
+static int move_cb_index(rm_move_cb on_move) {
+    if (on_move == NULL)
+        return 0;
+
+    for (int i = 0; i < RM_MOVE_CB_COUNT; i++) {
+        if (g_state->move_cbs[i] == on_move)
+            return i + 1;
+        if (g_state->move_cbs[i] == NULL) {
+            g_state->move_cbs[i] = on_move;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+
+static rm_handle_t malloc_with_cb(int size, rm_move_cb on_move, uint8_t tag) {
+    STATS_DECL;
+    STATS_START;
+    rm_header_t *h = NULL;
+    for (int attempt = 0; ; attempt++) {
+        if (heap_concurrent())
+            heap_mutex_lock();
+        int cb = move_cb_index(on_move);
+        if (cb >= 0) {
+            h = block_new(size);
+            if (h != NULL) {
+                h->move_cb = cb;
+                tag_set(h, tag);
+            }
+        }
+        if (heap_concurrent())
+            heap_mutex_unlock();
+
+        // the handler may compact, so it's called without the mutex
+        if (h != NULL || cb < 0 || attempt == RM_OOM_RETRIES || g_state->oom_handler == NULL)
+            break;
+        if (!g_state->oom_handler(size, g_state->oom_arg))
+            break;
+    }
+    STATS_END(RM_STATS_MALLOC);
 #if RMALLOC_DEBUG
     g_memlayout_sequence++;
     dump_memory_layout();
@@ -1239,6 +1785,8 @@ rm_handle_t rm_malloc(int size) {
         return NULL;
     }
 
+    TRACE(RM_TRACE_MALLOC, h, NULL, h->memory, h->size);
+
 #if RMALLOC_DEBUG
     //memset(h->memory, header_fillchar(h), h->size);
     //rebuild_free_block_slots();
@@ -1249,8 +1797,87 @@ rm_handle_t rm_malloc(int size) {
 }
 
 
+bool rm_set_oom_handler(rm_oom_handler handler, void *arg) {
+    // function addresses differ between processes
+    if (g_state->shared && handler != NULL)
+        return false;
+
+    g_state->oom_handler = handler;
+    g_state->oom_arg = arg;
+    return true;
+}
+
+
+/* whether block_new(size) has room, either on top or in a free block */
+static bool heap_has_room(uint32_t size) {
+    if (size < sizeof(free_memory_block_t))
+        size = sizeof(free_memory_block_t);
+    if ((uint8_t *)g_state->memory_top + size + sizeof(rm_header_t) < (uint8_t *)g_state->header_bottom)
+        return true;
+
+    // every block in a higher slot is large enough
+    int slot = rm_log2(size);
+    for (int i = slot + 1; i < g_state->free_block_slot_count; i++) {
+        if (g_state->free_block_slots[i] != NULL)
+            return true;
+    }
+    for (free_memory_block_t *b = g_state->free_block_slots[slot]; b != NULL; b = b->next) {
+        if (b->header->size >= size)
+            return true;
+    }
+    return false;
+}
+
+
+bool rm_oom_compact(int size, void *arg) {
+    uint32_t maxtime = arg != NULL ? *(uint32_t *)arg : 0;
+
+    if (heap_concurrent())
+        heap_mutex_lock();
+    uint64_t available = (uintptr_t)g_state->header_bottom - (uintptr_t)g_state->memory_top;
+    available += rm_stat_total_free_list();
+    bool possible = available >= (uint64_t)size + 2*sizeof(rm_header_t);
+    if (heap_concurrent())
+        heap_mutex_unlock();
+
+    // not enough free memory in total, compacting can't help
+    if (!possible)
+        return false;
+
+    // lowering the top is cheap, and often enough. rm_reserve() checks
+    rm_compact_trim(maxtime);
+    return rm_reserve(size, maxtime);
+}
+
+
+rm_handle_t rm_malloc(int size) {
+    return malloc_with_cb(size, NULL, 0);
+}
+
+
+rm_handle_t rm_malloc_movable_cb(int size, rm_move_cb on_move) {
+    return malloc_with_cb(size, on_move, 0);
+}
+
+
 void rm_free(rm_handle_t h) {
-    block_free((rm_header_t *)h);
+    if (h == NULL)
+        return;
+
+    STATS_DECL;
+    STATS_START;
+    if (heap_concurrent())
+        heap_mutex_lock();
+    zone_forget((rm_header_t *)h);
+    group_forget((rm_header_t *)h);
+    compress_forget((rm_header_t *)h);
+    index_forget((rm_header_t *)h);
+    tag_forget((rm_header_t *)h);
+    if (!dedup_free((rm_header_t *)h))
+        block_free((rm_header_t *)h);
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    STATS_END(RM_STATS_FREE);
 
 #if RMALLOC_DEBUG
     g_memlayout_sequence++;
@@ -1263,28 +1890,91 @@ void rm_free(rm_handle_t h) {
 
 
 void *rm_lock(rm_handle_t h) {
-    rm_header_t *f = (rm_header_t *)h;
-    f->type = BLOCK_TYPE_LOCKED;
+    STATS_DECL;
+    STATS_START;
+    rm_header_t *f = header_owner((rm_header_t *)h);
+    if (RMALLOC_COMPRESS && g_state->compress_ages != NULL && !compress_touch(f))
+        return NULL;
+    if (heap_concurrent()) {
+        concurrent_lock(f);
+    } else {
+        f->lock_count++;
+        f->type = BLOCK_TYPE_LOCKED;
+    }
+    sample_access(f);
+    STATS_END(RM_STATS_LOCK);
+
+    TRACE(RM_TRACE_LOCK, f, NULL, f->memory, f->size);
 
     return f->memory;
 }
 
 
 void *rm_weaklock(rm_handle_t h) {
-    rm_header_t *f = (rm_header_t *)h;
-    f->type = BLOCK_TYPE_WEAK_LOCKED;
+    STATS_DECL;
+    STATS_START;
+    rm_header_t *f = header_owner((rm_header_t *)h);
+    if (RMALLOC_COMPRESS && g_state->compress_ages != NULL && !compress_touch(f))
+        return NULL;
+    // no weak locks in concurrent heaps
+    if (heap_concurrent()) {
+        concurrent_lock(f);
+    } else {
+        f->lock_count++;
+        if (f->type != BLOCK_TYPE_LOCKED)
+            f->type = BLOCK_TYPE_WEAK_LOCKED;
+    }
+    sample_access(f);
+    STATS_END(RM_STATS_LOCK);
+
+    TRACE(RM_TRACE_LOCK, f, NULL, f->memory, f->size);
 
     return f->memory;
 }
 
 
 void rm_unlock(rm_handle_t h) {
-    rm_header_t *f = (rm_header_t *)h;
-    f->type = BLOCK_TYPE_UNLOCKED;
+    rm_header_t *f = header_owner((rm_header_t *)h);
+    if (heap_concurrent()) {
+        concurrent_unlock(f);
+    } else {
+        // locks nest, the block stays put until the last unlock
+        if (f->lock_count > 0)
+            f->lock_count--;
+        if (f->lock_count == 0)
+            f->type = BLOCK_TYPE_UNLOCKED;
+    }
+
+    TRACE(RM_TRACE_UNLOCK, f, NULL, f->memory, f->size);
 }
 
 
-void rm_compact(uint32_t maxtime) {
+/* rm_compact(), stopping early once there's a free block of 'reserve' bytes
+ * if reserve > 0
+ */
+static void compact_until(uint32_t maxtime, uint32_t reserve) {
+    STATS_DECL;
+    STATS_START;
+    STATS_COMPACT_START;
+
+    if (heap_concurrent())
+        concurrent_compact_begin();
+    pins_compact_begin();
+
+    // making room shouldn't wait for the zone, which claims the whole heap
+    if (reserve == 0 && g_state->lock_scores != NULL && copying_zone()) {
+        pins_compact_end();
+        if (heap_concurrent())
+            concurrent_compact_end();
+
+        STATS_END(RM_STATS_COMPACT);
+        STATS_COMPACT_END_NO_BUDGET;
+        return;
+    }
+
+    if (g_state->hugepage)
+        hugepage_evacuate();
+
     // sort headers in ascending memory order. headers with ->memory == NULL are in the end.
     rm_header_sort_all();
 
@@ -1335,6 +2025,20 @@ void rm_compact(uint32_t maxtime) {
             continue;
         }
 
+        if (reserve > 0 && free_size >= reserve) {
+            // merge the range into one block, and leave the rest alone
+            rm_header_t *after = free_last->next;
+            for (rm_header_t *f = free_first->next; f != after; ) {
+                rm_header_t *next = f->next;
+                header_set_unused(f);
+                f = next;
+            }
+            free_first->size = free_size;
+            free_first->next = after;
+            done = true;
+            continue;
+        }
+
         rm_header_t *start = free_last->next;
 
         if (start == NULL) {
@@ -1381,6 +2085,13 @@ void rm_compact(uint32_t maxtime) {
             break;
         }
 
+        if (heap_concurrent()) {
+            // blocks locked since the compaction started stay put
+            unlocked_last = concurrent_claim_range(unlocked_first, unlocked_last, &unlocked_size);
+            if (unlocked_last == NULL)
+                continue;
+        }
+
         rm_header_t *unlocked_last_next = unlocked_last->next;
         rm_header_t *free_last_next = free_last->next;
 
@@ -1394,8 +2105,12 @@ void rm_compact(uint32_t maxtime) {
             uintptr_t dest = src - used_offset;
             h->memory = (void *)dest;
             unlocked_size += h->size;
+            STATS_COMPACT_MOVED(h->size);
+            TRACE(RM_TRACE_MOVE, h, (void *)src, (void *)dest, h->size);
 
             memmove((void *)dest, (void *)src, h->size);
+            block_moved(h, (void *)src);
+            STATS_COMPACT_VISITED;
             h = h->next;
         }
 
@@ -1403,11 +2118,13 @@ void rm_compact(uint32_t maxtime) {
 
         uintptr_t free_memory_start = (uintptr_t)free_first->memory;
 
+        // the whole range is unlinked below
         h = free_first;
-        while (h && h != free_first->next) {
+        while (h && h != free_last_next) {
+            rm_header_t *next = h->next;
             header_set_unused(h);
 
-            h = h->next;
+            h = next;
         }
 
         if (adjacent) {
@@ -1518,6 +2235,7 @@ void rm_compact(uint32_t maxtime) {
 
                 // Extend LU
                 unlocked_last->size += (free_size - unlocked_size);
+                tag_charge(unlocked_last, free_size - unlocked_size);
 
                 // Link LU to C
                 unlocked_last->next = free_last_next;
@@ -1562,6 +2280,9 @@ void rm_compact(uint32_t maxtime) {
 
         update_highest_address_if_needed(unlocked_last);
 
+        if (heap_concurrent())
+            concurrent_release_range(unlocked_first, unlocked_last);
+
         root = unlocked_last;
 
 #if RMALLOC_DEBUG
@@ -1599,36 +2320,41 @@ void rm_compact(uint32_t maxtime) {
         }
         //else fprintf(stderr, "=> FREE 0x%X size %04d offset from bottom: %d bytes (%d kb)\n", h->memory, h->size, offset, offset/1024);
 
+        STATS_COMPACT_VISITED;
         h = h->next;
     }
 
     // prune all free blocks above highest address.
     h = g_state->header_root;
     while (h != NULL) {
-        rm_header_t *h2 = h;
-        bool kill = false;
-        if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_FREE && (uintptr_t)h->memory >= highest_used_address) {
+        rm_header_t *next = h->next;
+        if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_FREE && (uintptr_t)h->memory >= highest_used_address)
             header_set_unused(h);
-            kill = true;
-        }
-        h = h->next;
-        if (kill)
-            h2->next = NULL;
+        STATS_COMPACT_VISITED;
+        h = next;
     }
 
     // remove from list.
     largest_header->next = NULL;
 
     // adjust g_header_bottom
-    while (rm_header_is_unused(g_state->header_bottom)) {
-        g_state->header_bottom++;
-    }
+    header_trim();
 
     rebuild_free_block_slots();
 
     // Let's hope this works!
     g_state->memory_top = (void *)highest_used_address;
 
+    if (g_state->hugepage)
+        hugepage_trim();
+
+    pins_compact_end();
+    if (heap_concurrent())
+        concurrent_compact_end();
+
+    STATS_END(RM_STATS_COMPACT);
+    STATS_COMPACT_END(uptime_nanoseconds() - start_time, maxtime);
+
 #if RMALLOC_DEBUG
     fprintf(stderr, "New top (after %d items of total size %d bytes): 0x%X, topmost header at 0x%X + %d = 0x%X\n", count, total_size, g_memory_top, largest_header->memory, largest_header->size, (ptr_t)largest_header->memory + largest_header->size);
 
@@ -1648,3 +2374,55 @@ void rm_compact(uint32_t maxtime) {
     dump_memory_layout();
 #endif
 }
+
+
+void rm_compact(uint32_t maxtime) {
+    uint64_t start_time = uptime_nanoseconds();
+
+    // pinned blocks are kept as they are, like locked ones. neither pass
+    // runs in concurrent heaps, where the types come from the lock counts.
+    if (!heap_concurrent()) {
+        pins_compact_begin();
+        dedup_collapse(start_time, maxtime);
+        compress_cold(start_time, maxtime);
+        pins_compact_end();
+    }
+
+    // what's left of the budget. at least 1, the work done regardless of it
+    // (emptying the top huge page) is still done.
+    if (maxtime > 0) {
+        uint64_t time_diff = uptime_nanoseconds() - start_time;
+        maxtime = time_diff < maxtime ? maxtime - time_diff : 1;
+    }
+    compact_until(maxtime, 0);
+}
+
+
+uint32_t rm_trim_headers(void) {
+    if (heap_concurrent())
+        heap_mutex_lock();
+    uint32_t bytes = header_trim();
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    return bytes;
+}
+
+
+bool rm_reserve(uint32_t bytes, uint32_t maxtime) {
+    if (heap_concurrent())
+        heap_mutex_lock();
+    bool room = heap_has_room(bytes);
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    if (room)
+        return true;
+
+    compact_until(maxtime, bytes);
+
+    if (heap_concurrent())
+        heap_mutex_lock();
+    room = heap_has_room(bytes);
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    return room;
+}
@@ -50,17 +50,485 @@ typedef struct rmalloc_meta_t rmalloc_meta_t;
 void rm_init(void *heap, uint32_t size);
 void rm_destroy(void);
 
+/* persistent heap, mapped from a file.
+ *
+ * a new file is created with the given size. an existing file is reopened
+ * with its state intact; size must then be 0 or the size it was created with.
+ * blocks locked when it was closed, or when the process crashed, are
+ * unlocked.
+ * rm_sync() flushes the heap to disk, rm_destroy() syncs and unmaps it.
+ *
+ * handles are not stable across mappings, store rm_handle_index() instead.
+ */
+bool rm_init_file(const char *path, uint32_t size);
+bool rm_sync(void);
+
+/* heap in a POSIX shared memory object, usable from several processes.
+ *
+ * the first process creates the object with size > 0, the others attach
+ * with size 0. all processes map the heap at the same address, so handles
+ * can be passed between them as is. that address is picked from a range
+ * that processes don't otherwise use (RM_SHARED_BASE in compact_file.c), so
+ * unrelated processes can attach too. attaching fails if it is taken
+ * anyway. rm_destroy() unmaps the heap, shm_unlink() removes it.
+ *
+ * rm_malloc(), rm_free() and rm_compact() are serialized between processes.
+ * rm_lock()/rm_unlock() are lock-free and nest, a block stays put until
+ * every process has unlocked it.
+ */
+bool rm_init_shared(const char *name, uint32_t size);
+
+/* heap on huge pages, to save TLB misses on large heaps.
+ *
+ * the heap is mapped aligned to RM_HUGEPAGE_SIZE, from the reserved huge
+ * page pool if there is one and with transparent huge pages otherwise. size
+ * is rounded up to a whole number of huge pages.
+ *
+ * rm_compact() first tries to empty the topmost huge page, and gives back
+ * whole huge pages above the used memory, never parts of one.
+ * rm_destroy() unmaps the heap.
+ */
+#define RM_HUGEPAGE_SIZE (2*1024*1024)
+
+bool rm_init_hugepage(uint32_t size);
+
+uint32_t rm_handle_index(rm_handle_t h);
+rm_handle_t rm_handle_from_index(uint32_t index);
+
+/* 32-bit handles, for structures that hold many of them.
+ *
+ * rm_index(h) packs a handle into 32 bits: its handle index plus one, so
+ * that 0 is no handle, and a generation in the top RM_INDEX_GENERATION_BITS
+ * bits (1 to 8), which changes each time the handle is freed.
+ * rm_index_handle() and rm_index_lock() return NULL for 0 and for freed
+ * handles, until the generation has wrapped around. rm_index() returns 0 if
+ * the index doesn't fit in the bits that are left.
+ *
+ * the generations are kept from the first rm_index() on, but not in file or
+ * shared heaps, where they're 0 and only handles whose block is free are
+ * caught. the index is then rm_handle_index() + 1, stable across mappings.
+ */
+#ifndef RM_INDEX_GENERATION_BITS
+#define RM_INDEX_GENERATION_BITS 8
+#endif
+#define RM_INDEX_BITS (32 - RM_INDEX_GENERATION_BITS)
+
+typedef uint32_t rm_index_t;
+
+rm_index_t rm_index(rm_handle_t h);
+rm_handle_t rm_index_handle(rm_index_t i);
+void *rm_index_lock(rm_index_t i);
+void rm_index_unlock(rm_index_t i);
+
+/* arenas: separate heaps on caller-supplied regions, independent of the
+ * global heap and of each other. the arena's state is stored at the start
+ * of the region. the arena calls use it on the calling thread only, other
+ * threads may use the global heap or arenas of their own meanwhile. one
+ * arena is for one thread at a time.
+ *
+ * rm_arena_reset() drops every handle in the arena at once, in constant time.
+ * the region is owned by the caller, there's nothing to destroy.
+ */
+typedef struct rm_arena_t rm_arena_t;
+
+rm_arena_t *rm_arena_create(void *region, uint32_t size);
+void rm_arena_reset(rm_arena_t *arena);
+rm_handle_t rm_arena_malloc(rm_arena_t *arena, int size);
+void rm_arena_free(rm_arena_t *arena, rm_handle_t h);
+void *rm_arena_lock(rm_arena_t *arena, rm_handle_t h);
+void rm_arena_unlock(rm_arena_t *arena, rm_handle_t h);
+void rm_arena_compact(rm_arena_t *arena, uint32_t maxtime);
+
+/* handle groups: blocks allocated together and freed together.
+ *
+ * rm_group_malloc() places a group's blocks next to each other, carved out
+ * of chunks of chunk_size bytes (RM_GROUP_CHUNK_SIZE if 0), blocks larger
+ * than that get a block of their own. rm_compact() keeps them in order, and
+ * rm_compact_copying() and rm_compact_locality() keep a group's blocks
+ * together. rm_compact_trim() doesn't. up to chunk_size bytes per group are
+ * held for its next blocks.
+ *
+ * rm_group_free() frees all blocks of the group and the group itself, in one
+ * pass over its blocks. the blocks can still be rm_free()'d on their own.
+ *
+ * up to RM_GROUP_COUNT groups at a time, rm_group_create() returns 0 after
+ * that, and for shared heaps. a reopened file heap forgets its groups, their
+ * blocks stay allocated.
+ */
+typedef uint32_t rm_group_t;
+
+#define RM_GROUP_COUNT 255
+#define RM_GROUP_CHUNK_SIZE 4096
+
+rm_group_t rm_group_create(uint32_t chunk_size);
+rm_handle_t rm_group_malloc(rm_group_t group, int size);
+void rm_group_free(rm_group_t group);
+
+/* placement policies, set after rm_init() or any of its variants.
+ *
+ * RM_PLACEMENT_DEFAULT grows the heap while there's room, and then takes the
+ * first block of the first non-empty free slot, from its high end.
+ *
+ * the others use free blocks before growing the heap, and take the new block
+ * from the low end of the free block:
+ * - RM_PLACEMENT_LOW: the first block that fits, in the lowest slot that has one
+ * - RM_PLACEMENT_FIRST_FIT: the lowest address that fits, in any slot
+ * - RM_PLACEMENT_BEST_FIT: the smallest block that fits, in the lowest slot
+ *   that has one
+ */
+typedef enum {
+    RM_PLACEMENT_DEFAULT = 0,
+    RM_PLACEMENT_LOW,
+    RM_PLACEMENT_FIRST_FIT,
+    RM_PLACEMENT_BEST_FIT,
+} rm_placement_t;
+
+void rm_set_placement(rm_placement_t placement);
+
 rmalloc_meta_t* rm_get_state(void);
 void rm_set_state(rmalloc_meta_t *state);
 size_t rm_state_size(void);
 
 rm_handle_t rm_malloc(int size);
+
+/* relocation callbacks
+ *
+ * for blocks that hold pointers into themselves, and so would otherwise have
+ * to stay locked. after compaction has moved the block, on_move is called
+ * with its old and new address, and can fix the pointers up at the new
+ * address. the old memory may already be overwritten.
+ *
+ * the callback runs on the thread that compacts, one block at a time, also
+ * in rm_compact_parallel(). it runs while the heap is being compacted: it
+ * must not call rmalloc, except to lock blocks that aren't being moved in
+ * heaps that aren't concurrent. up to RM_MOVE_CB_COUNT different callbacks
+ * per heap, rm_malloc_movable_cb() returns NULL after that. not for shared
+ * heaps, function addresses differ between processes, and a reopened file
+ * heap forgets the callbacks.
+ */
+typedef void (*rm_move_cb)(rm_handle_t h, void *old_address, void *new_address);
+
+#define RM_MOVE_CB_COUNT 16
+
+rm_handle_t rm_malloc_movable_cb(int size, rm_move_cb on_move);
+
+/* out of memory handling
+ *
+ * when rm_malloc() or rm_malloc_movable_cb() finds no room, it calls the
+ * handler with the size and arg, and tries again if the handler returns
+ * true, up to RM_OOM_RETRIES times. the handler may call rmalloc, e.g. to
+ * free cached blocks or compact. in concurrent heaps it's called without
+ * the heap mutex held.
+ *
+ * rm_oom_compact() is the built-in handler: it gives up right away if there
+ * aren't enough free bytes in total, and otherwise runs rm_compact_trim(),
+ * and rm_reserve(size) if that wasn't enough, with maxtime taken from the
+ * uint32_t that arg points to, or unlimited if arg is NULL. in concurrent
+ * heaps, neither makes rm_lock() in other threads wait for more than the
+ * block being moved. handlers that free memory of their own can call it
+ * afterwards.
+ *
+ * no handler (NULL) by default, rm_malloc() then just returns NULL. returns
+ * false for shared heaps, and a reopened file heap forgets the handler.
+ */
+typedef bool (*rm_oom_handler)(int size, void *arg);
+
+#define RM_OOM_RETRIES 2
+
+bool rm_set_oom_handler(rm_oom_handler handler, void *arg);
+bool rm_oom_compact(int size, void *arg);
+
+/* tagged blocks, for accounting by subsystem.
+ *
+ * rm_malloc_tagged() is rm_malloc() for a block of one of the tags 1 to
+ * RM_TAG_COUNT - 1. rm_tag_usage() tells how many bytes of the heap the tag's
+ * blocks take up, and how many handles it has, without walking the headers.
+ * the bytes follow the blocks through compaction, compression and spilling,
+ * and a block shared by rm_compact() (see rm_mark_immutable()) counts for
+ * none of the tags of its handles.
+ *
+ * rm_set_tag_limit() gives a tag a soft limit: every rm_malloc_tagged() that
+ * leaves the tag above it calls on_limit with the tag's bytes and arg, after
+ * the allocation, so that the subsystem can free what it can spare before
+ * the heap runs out. the callback may call rmalloc. 0 = no limit, the
+ * default.
+ *
+ * the tags take a byte per possible header, malloc()'ed: rm_malloc_tagged()
+ * returns NULL and rm_set_tag_limit() false in shared heaps, and a reopened
+ * file heap forgets the tags, limits and counts. its blocks stay allocated.
+ */
+typedef void (*rm_tag_limit_cb)(uint8_t tag, uint64_t bytes, void *arg);
+
+#define RM_TAG_COUNT 16
+
+rm_handle_t rm_malloc_tagged(int size, uint8_t tag);
+bool rm_tag_usage(uint8_t tag, uint64_t *bytes, uint32_t *handles);
+bool rm_set_tag_limit(uint8_t tag, uint64_t limit, rm_tag_limit_cb on_limit, void *arg);
+
 void rm_free(rm_handle_t);
 void *rm_lock(rm_handle_t);
 void *rm_weaklock(rm_handle_t);
-void rm_unlock(rm_handle_t);
+void rm_unlock(rm_handle_t); // locks nest, the block may move after the last unlock
 void rm_compact(uint32_t maxtime);
 
+/* make room for a burst of allocations ahead of time.
+ *
+ * compacts like rm_compact(maxtime), but stops as soon as there's a free
+ * block of at least 'bytes', or that many bytes free above the used memory,
+ * and doesn't move blocks into the pinned zone.
+ * returns whether there is one afterwards, right away if there already was.
+ */
+bool rm_reserve(uint32_t bytes, uint32_t maxtime);
+
+/* give the unused headers at the bottom of the header table back to the
+ * blocks. unused headers are reused top first, so after a burst of frees and
+ * rm_compact(), the table can shrink back. the compactions do it too.
+ * returns the bytes given back.
+ */
+uint32_t rm_trim_headers(void);
+
+/* compression of cold blocks
+ *
+ * with rm_set_compression(cold_after), rm_compact() first compresses the
+ * blocks of at least RM_COMPRESS_MIN_SIZE bytes that haven't been locked or
+ * pinned since cold_after calls ago (up to 31), in place, and reclaims
+ * what they no longer need. this counts towards rm_compact()'s maxtime, and
+ * what's left when it's up is compressed by the next call. blocks that don't shrink by an eighth are left
+ * as they are until they've been locked again, and blocks with a relocation
+ * callback aren't compressed. rm_lock(), rm_weaklock() and rm_pin()
+ * decompress the block into a new one, and return NULL if there's no room
+ * for it.
+ *
+ * 0 decompresses all blocks and turns it off, which fails if there's no
+ * room. returns false for concurrent, shared and file heaps.
+ * rm_compact_background_start() turns it off.
+ */
+#define RM_COMPRESS_MIN_SIZE 256
+
+bool rm_set_compression(uint32_t cold_after);
+
+/* spilling cold blocks to a file
+ *
+ * with rm_set_spill(path, cold_after), rm_compact() first writes the
+ * blocks of at least RM_COMPRESS_MIN_SIZE bytes that haven't been locked or
+ * pinned since cold_after calls ago (up to 31) to a file, and only keeps
+ * a stub of each in the heap. the file is created at path and unlinked right
+ * away. with compression on too, blocks are spilled compressed. rm_lock(),
+ * rm_weaklock() and rm_pin() read the block back into a new one, and return
+ * NULL if there's no room for it or the read fails.
+ *
+ * rm_prefetch() hints that a spilled block will be locked soon, so that the
+ * kernel can start reading it. a NULL path reads all blocks back and closes
+ * the file, which fails if there's no room. returns false for concurrent,
+ * shared and file heaps, and if it's on already.
+ * rm_compact_background_start() turns it off.
+ */
+bool rm_set_spill(const char *path, uint32_t cold_after);
+void rm_prefetch(rm_handle_t h);
+
+/* sharing identical blocks
+ *
+ * rm_mark_immutable() promises that the block won't be written to again.
+ * rm_compact() then collapses the immutable blocks, neither locked nor
+ * pinned, that are identical, byte for byte, into one copy that their
+ * handles share. locking any of them locks the copy, and it goes with the
+ * last handle freed.
+ * writing to a shared block changes it for all of its handles.
+ *
+ * returns false for concurrent and shared heaps, and blocks with a
+ * relocation callback. collapsing is skipped while the heap is concurrent.
+ */
+bool rm_mark_immutable(rm_handle_t h);
+
+/* pinning
+ *
+ * rm_pin()/rm_unpin() work like rm_lock()/rm_unlock(), but record the
+ * handle in a small per-thread set instead of writing the header, so hot
+ * handles shared between threads don't bounce a cache line on every access.
+ * rm_compact() checks all threads' sets for its heap and leaves pinned
+ * blocks alone.
+ *
+ * pins nest, and must be undone by the thread that made them. a thread
+ * holding more than RM_PIN_SET_SIZE pins, and shared heaps, fall back to
+ * rm_lock().
+ */
+#define RM_PIN_SET_SIZE 16
+
+void *rm_pin(rm_handle_t h);
+void rm_unpin(rm_handle_t h);
+
+/* background compaction
+ *
+ * runs rm_compact(maxtime) every 'interval' nanoseconds on a thread of its
+ * own. while it runs, the heap may be used from any thread: rm_malloc(),
+ * rm_free() and rm_compact() take a mutex, rm_lock()/rm_unlock() are
+ * lock-free and nest. rm_compact() and rm_compact_trim() claim each block
+ * right before moving it, so rm_lock() only waits if that very block is
+ * being moved. rm_compact_copying(), rm_compact_locality(),
+ * rm_compact_parallel() and the moves of rm_compact() into the pinned zone
+ * plan all moves up front and claim every unlocked block for the whole
+ * pass, rm_lock() of any unlocked block waits for them. weak locks are
+ * plain locks while the compactor runs.
+ *
+ * start it before other threads use the heap, and stop it before
+ * rm_set_state(), the thread compacts whatever heap is current. arena
+ * calls don't change it. rm_destroy() stops it. link with -lpthread.
+ */
+bool rm_compact_background_start(uint32_t interval, uint32_t maxtime);
+void rm_compact_background_stop(void);
+
+/* parallel compaction
+ *
+ * compacts the whole heap using up to 'threads' threads, the calling thread
+ * being one of them. unlike rm_compact(), unlocked blocks are never moved
+ * past a locked block: each run of unlocked blocks slides down to the end of
+ * the locked block below it, so a heap with many locked blocks ends up a
+ * little less compact. the threads work on separate parts of the heap and
+ * only wait for each other where a block's new place overlaps blocks another
+ * thread hasn't moved yet.
+ *
+ * blocks until done, there's no maxtime. link with -lpthread.
+ */
+#define RM_COMPACT_MAX_THREADS 64
+
+void rm_compact_parallel(uint32_t threads);
+
+/* copying compaction, for heaps where most blocks die between compactions.
+ *
+ * copies the unlocked blocks out to a temporary to-space and back to the
+ * bottom of the heap, in handle order, around the locked blocks. the cost
+ * is proportional to the live data and the header table, free blocks are
+ * never walked. a block too large for the hole below a locked block goes
+ * past it, and if that would end the blocks higher up than before, they're
+ * placed in address order instead. returns false, having done nothing, if
+ * the to-space can't be allocated with malloc().
+ */
+bool rm_compact_copying(void);
+
+/* trim compaction, for lowering memory_top with as little copying as
+ * possible.
+ *
+ * moves the topmost unlocked blocks, one at a time, into the lowest free
+ * block below them that they fit in, until a block is locked or doesn't fit
+ * anywhere below, or maxtime (if > 0) is up. only the blocks above the new
+ * top are copied, holes that nothing above fits in are left for rm_compact().
+ */
+void rm_compact_trim(uint32_t maxtime);
+
+/* locality compaction
+ *
+ * with sampling on, every 'every'th rm_lock(), rm_weaklock() or rm_pin() is
+ * recorded in a ring of the last RM_SAMPLE_COUNT samples. rm_compact_locality()
+ * then compacts like rm_compact_copying(), but places the sampled blocks
+ * first, in the order they were first seen, so blocks that are used
+ * together end up next to each other. the ring is emptied afterwards.
+ * sampling is off (0) by default. the ring is allocated by the first
+ * rm_set_sampling() that turns it on, and sampling stays off in shared heaps.
+ */
+#define RM_SAMPLE_COUNT 1024
+
+void rm_set_sampling(uint32_t every);
+bool rm_compact_locality(void);
+
+/* pinned zone
+ *
+ * with the zone on, every lock of a handle is counted, and so is every
+ * rm_compact() that finds it locked. handles that are locked often, or for
+ * long, are moved to a zone at the bottom of the heap by the first
+ * rm_compact() that finds them unlocked, so they don't pin the middle of the
+ * heap, and the free space above them stays in one piece. that rm_compact()
+ * works like rm_compact_copying() and ignores maxtime. the counts decay with
+ * every rm_compact(), only recent behaviour counts.
+ *
+ * off by default. returns false in shared heaps, or if the counts (one byte
+ * per possible handle) can't be allocated. it can't be turned on or off
+ * while the heap is concurrent, e.g. during background compaction.
+ */
+bool rm_set_pinned_zone(bool on);
+
+/* latency histograms
+ *
+ * only collected when compact.c is built with RMALLOC_STATS=1 (make stats),
+ * otherwise rm_stats_histogram() returns false.
+ *
+ * operations are measured in cycles (rdtsc, or nanoseconds where not
+ * available). each rm_compact() call also records bytes moved, headers
+ * visited and time used in percent of maxtime (if maxtime > 0). recording
+ * is thread-safe, rm_stats_histogram() takes a snapshot that may be torn by
+ * records made meanwhile.
+ */
+typedef enum {
+    RM_STATS_MALLOC = 0,
+    RM_STATS_FREE,
+    RM_STATS_LOCK,
+    RM_STATS_COMPACT,
+    RM_STATS_COMPACT_BYTES_MOVED,
+    RM_STATS_COMPACT_HEADERS_VISITED,
+    RM_STATS_COMPACT_BUDGET_USED,
+    RM_STATS_COUNT
+} rm_stats_kind_t;
+
+#define RM_HISTOGRAM_SUB_BUCKETS 4
+#define RM_HISTOGRAM_BUCKETS (64*RM_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct rm_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[RM_HISTOGRAM_BUCKETS];
+} rm_histogram_t;
+
+bool rm_stats_histogram(rm_stats_kind_t kind, rm_histogram_t *hist);
+void rm_stats_reset(void);
+uint64_t rm_stats_bucket_value(int bucket); // lowest value counted in bucket
+
+/* binary event tracing
+ *
+ * only available when compact.c is built with RMALLOC_TRACE=1 (make trace),
+ * otherwise rm_trace_start() returns false. link with -lpthread.
+ *
+ * records are written lock-free to per-thread ring buffers and flushed to
+ * the file by a background thread. records that don't fit in a full buffer
+ * are dropped and counted by rm_trace_dropped(). rm_trace_stop() waits for
+ * the records being written, every record is either in the file or counted.
+ *
+ * translate to the ops format used by src/steve with
+ * memtrace-to-ops/translate-rmtrace-to-ops.py.
+ */
+#define RM_TRACE_MAGIC "RMTRACE"
+#define RM_TRACE_VERSION 1
+
+enum {
+    RM_TRACE_MALLOC = 'N', // new_address, size
+    RM_TRACE_FREE   = 'F', // old_address, size
+    RM_TRACE_LOCK   = 'L', // new_address (current address), size
+    RM_TRACE_UNLOCK = 'U',
+    RM_TRACE_MOVE   = 'R', // relocated by compaction: old_address -> new_address
+};
+
+#pragma pack(1)
+typedef struct rm_trace_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} rm_trace_file_header_t;
+
+typedef struct rm_trace_record_t {
+    uint64_t timestamp; // nanoseconds, monotonic
+    uint64_t handle;
+    uint64_t old_address;
+    uint64_t new_address;
+    uint32_t size;
+    uint8_t op;
+    uint8_t reserved[3];
+} rm_trace_record_t;
+#pragma pack()
+
+bool rm_trace_start(const char *path);
+void rm_trace_stop(void);
+uint64_t rm_trace_dropped(void);
+
 
 
 #ifdef __cplusplus
@@ -0,0 +1,402 @@
+/* compact_compress.c
+ *
+ * compression of cold blocks, see rm_set_compression().
+ *
+ * included from compact.c.
+ *
+ * each handle has an age byte: the number of rm_compact() calls it's been
+ * unlocked for, and flags for blocks that are compressed, or didn't shrink
+ * enough and aren't tried again until they're locked, or are spilled to a
+ * file (see compact_spill.c). a cold block is compressed in place, behind
+ * the original size, and the rest of it is split off and freed, for
+ * rm_compact() to reclaim right after. the compressed block is an ordinary
+ * unlocked block, and moves like one.
+ *
+ * locking a compressed block allocates a block of the original size,
+ * decompresses into it and hands it the handle. the compressed block is
+ * freed. blocks with a relocation callback aren't compressed, compaction
+ * would call it on the compressed bytes.
+ *
+ * the compression is a small LZ77, which is what text, markup and most
+ * structs shrink by: a control byte below 128 is followed by that many plus
+ * one literal bytes, otherwise it's a match of its low bits plus
+ * LZ_MIN_MATCH bytes, at the 16-bit offset that follows. matches are found
+ * through a hash table of the last position of each 4 byte sequence, with
+ * growing steps while nothing matches.
+ *
+ * decompressing in rm_lock() would need the heap mutex, and the blocks would
+ * have to be claimed while they're compressed, so it's only for plain
+ * heaps. the ages are malloc()'ed, so neither for shared nor file heaps.
+ */
+
+#define COMPRESSED 0x80
+#define INCOMPRESSIBLE 0x40 // until it's locked again
+#define SPILLED 0x20
+#define COMPRESS_AGE_MASK 0x1f
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (127 + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 128
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+#if RMALLOC_COMPRESS
+
+static uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static bool lz_literals(const uint8_t *in, uint32_t count, uint8_t *out, uint32_t *op, uint32_t limit) {
+    while (count > 0) {
+        uint32_t run = count < LZ_MAX_LITERALS ? count : LZ_MAX_LITERALS;
+        if (*op + 1 + run > limit)
+            return false;
+        out[(*op)++] = run - 1;
+        memcpy(out + *op, in, run);
+        *op += run;
+        in += run;
+        count -= run;
+    }
+    return true;
+}
+
+
+/* the compressed size, or 0 if it's more than limit */
+static uint32_t lz_compress(const uint8_t *in, uint32_t size, uint8_t *out, uint32_t limit) {
+    uint32_t table[1 << LZ_HASH_BITS]; // position + 1, 0 = none
+    memset(table, 0, sizeof(table));
+
+    // the longer there's been no match, the bigger the steps, so data that
+    // doesn't compress is given up on quickly
+    uint32_t ip = 0, literal = 0, op = 0, misses = 0;
+    while (ip + LZ_MIN_MATCH <= size) {
+        uint32_t v = lz_load32(in + ip);
+        uint32_t hash = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = ip + 1;
+
+        if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET || lz_load32(in + candidate - 1) != v) {
+            if (op + ip - literal > limit)
+                return 0;
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        uint32_t ref = candidate - 1, length = LZ_MIN_MATCH;
+        while (ip + length < size && length < LZ_MAX_MATCH && in[ref + length] == in[ip + length])
+            length++;
+
+        if (!lz_literals(in + literal, ip - literal, out, &op, limit) || op + 3 > limit)
+            return 0;
+        uint32_t offset = ip - ref;
+        out[op++] = 0x80 | (length - LZ_MIN_MATCH);
+        out[op++] = offset & 0xff;
+        out[op++] = offset >> 8;
+
+        ip += length;
+        literal = ip;
+    }
+
+    if (!lz_literals(in + literal, size - literal, out, &op, limit))
+        return 0;
+    return op;
+}
+
+
+static bool lz_decompress(const uint8_t *in, uint32_t size, uint8_t *out, uint32_t out_size) {
+    uint32_t ip = 0, op = 0;
+    // the compressed block may be padded at the end
+    while (ip < size && op < out_size) {
+        uint32_t control = in[ip++];
+        if (control < 0x80) {
+            uint32_t run = control + 1;
+            if (ip + run > size || op + run > out_size)
+                return false;
+            memcpy(out + op, in + ip, run);
+            ip += run;
+            op += run;
+        } else {
+            uint32_t length = (control & 0x7f) + LZ_MIN_MATCH;
+            if (ip + 2 > size)
+                return false;
+            uint32_t offset = in[ip] | (in[ip + 1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > op || op + length > out_size)
+                return false;
+            // may overlap, in pieces of at most offset bytes
+            while (length > 0) {
+                uint32_t piece = length < offset ? length : offset;
+                memcpy(out + op, out + op - offset, piece);
+                op += piece;
+                length -= piece;
+            }
+        }
+    }
+    return op == out_size;
+}
+
+
+static bool spill_in(rm_header_t *h);
+static bool spill_out(rm_header_t *h);
+static void spill_release(rm_header_t *h);
+
+
+static uint8_t *compress_age(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    return index < g_state->compress_ages_count ? &g_state->compress_ages[index] : NULL;
+}
+
+
+static bool compress_ages_alloc(void) {
+    if (g_state->compress_ages != NULL)
+        return true;
+
+    uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+    g_state->compress_ages = (uint8_t *)calloc(count, 1);
+    if (g_state->compress_ages == NULL)
+        return false;
+    g_state->compress_ages_count = count;
+    return true;
+}
+
+
+/* a freed handle's index is reused, and mustn't look compressed */
+static void compress_forget(rm_header_t *h) {
+    uint8_t *age = compress_age(h);
+    if (age == NULL)
+        return;
+    if (*age & SPILLED)
+        spill_release(h);
+    *age = 0;
+}
+
+
+/* the handle takes n's memory, and its own is freed under n */
+static void block_replace(rm_header_t *h, rm_header_t *n) {
+    void *old_memory = h->memory;
+    uint32_t old_size = h->size;
+    h->memory = n->memory;
+    h->size = n->size;
+    n->memory = old_memory;
+    n->size = old_size;
+    block_free(n);
+    tag_charge(h, (int64_t)h->size - old_size);
+
+    TRACE(RM_TRACE_MOVE, h, old_memory, h->memory, h->size);
+}
+
+
+/* split off what's beyond the first 'kept' bytes of h, and free it. the
+ * caller has to be done with those bytes.
+ */
+static bool block_shrink(rm_header_t *h, uint32_t kept) {
+    kept = (kept + sizeof(void *) - 1) & ~(uint32_t)(sizeof(void *) - 1);
+    if (kept < sizeof(free_memory_block_t))
+        kept = sizeof(free_memory_block_t);
+    if (h->size < kept + sizeof(free_memory_block_t))
+        return false;
+
+    rm_header_t *rest = header_new(/*insert_in_list*/true);
+    if (rest == NULL)
+        return false;
+
+    rest->memory = (uint8_t *)h->memory + kept;
+    rest->size = h->size - kept;
+    rest->type = BLOCK_TYPE_UNLOCKED;
+    rest->move_cb = 0;
+    g_state->header_used_count++;
+    h->size = kept;
+    tag_charge(h, -(int64_t)rest->size);
+    block_free(rest);
+    return true;
+}
+
+
+static bool decompress_block(rm_header_t *h) {
+    uint32_t size;
+    memcpy(&size, h->memory, sizeof(size));
+    rm_header_t *n = block_new(size);
+    if (n == NULL)
+        return false;
+
+    if (!lz_decompress((uint8_t *)h->memory + sizeof(size), h->size - sizeof(size), (uint8_t *)n->memory, size))
+        abort();
+
+    block_replace(h, n);
+    return true;
+}
+
+
+/* called by rm_lock() and friends before locking. brings the block back if
+ * it's spilled or compressed, and tells whether it could.
+ */
+static bool compress_touch(rm_header_t *h) {
+    uint8_t *age = compress_age(h);
+    if (age == NULL)
+        return true;
+    if (!(*age & (COMPRESSED | SPILLED))) {
+        if (*age != 0)
+            *age = 0;
+        return true;
+    }
+
+    if (*age & SPILLED) {
+        if (!spill_in(h))
+            return false;
+        *age &= ~SPILLED;
+    }
+    if ((*age & COMPRESSED) && !decompress_block(h))
+        return false;
+
+    *age = 0;
+    return true;
+}
+
+
+/* compress h in place, with buffer as scratch space of h->size bytes */
+static bool compress_block(rm_header_t *h, uint8_t *buffer) {
+    uint32_t size = h->size;
+    uint32_t length = lz_compress((uint8_t *)h->memory, size, buffer, size - size / 8 - sizeof(size));
+    if (length == 0)
+        return false;
+
+    if (!block_shrink(h, sizeof(size) + length))
+        return false;
+
+    memcpy(h->memory, &size, sizeof(size));
+    memcpy((uint8_t *)h->memory + sizeof(size), buffer, length);
+    return true;
+}
+
+
+/* called by rm_compact() before compacting. ages the unlocked blocks, and
+ * compresses or spills those that have got cold until maxtime (if > 0) is
+ * up. the rest stay cold, for the next call.
+ */
+static void compress_cold(uint64_t start_time, uint32_t maxtime) {
+    if (g_state->compress_ages == NULL)
+        return;
+
+    uint32_t largest = 0;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_UNLOCKED && h->size > largest)
+            largest = h->size;
+    }
+    uint8_t *buffer = (uint8_t *)malloc(largest + 1);
+    if (buffer == NULL)
+        return;
+
+    bool done = false;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE)
+            continue;
+
+        uint8_t *age = compress_age(h);
+        if (age == NULL)
+            continue;
+        if (h->type != BLOCK_TYPE_UNLOCKED) {
+            *age &= COMPRESSED;
+            continue;
+        }
+        if (*age & SPILLED)
+            continue;
+
+        // calls since the last lock, not counting this one
+        uint8_t cold = *age & COMPRESS_AGE_MASK;
+        if (cold < COMPRESS_AGE_MASK)
+            (*age)++;
+        if (done || (!(*age & COMPRESSED) && h->size < RM_COMPRESS_MIN_SIZE) || h->move_cb != 0
+            || group_is_chunk(h))
+            continue;
+
+        if (g_state->compress_cold_after != 0 && cold >= g_state->compress_cold_after
+            && !(*age & (COMPRESSED | INCOMPRESSIBLE)))
+            *age |= compress_block(h, buffer) ? COMPRESSED : INCOMPRESSIBLE;
+
+        if (g_state->spill_fd >= 0 && cold >= g_state->spill_cold_after && spill_out(h))
+            *age |= SPILLED;
+
+        done = maxtime > 0 && uptime_nanoseconds() - start_time >= maxtime;
+    }
+
+    free(buffer);
+}
+
+
+bool rm_set_compression(uint32_t cold_after) {
+    if (cold_after == 0) {
+        if (g_state->compress_ages == NULL)
+            return true;
+
+        // spilled ones are brought back too
+        for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+            uint8_t *age = compress_age(h);
+            if (age != NULL && (*age & COMPRESSED) && !compress_touch(h))
+                return false;
+        }
+        g_state->compress_cold_after = 0;
+        if (g_state->spill_fd < 0) {
+            free(g_state->compress_ages);
+            g_state->compress_ages = NULL;
+            g_state->compress_ages_count = 0;
+        }
+        return true;
+    }
+
+    if (heap_concurrent() || g_state->mapping != NULL || !compress_ages_alloc())
+        return false;
+
+    g_state->compress_cold_after = cold_after < COMPRESS_AGE_MASK ? cold_after : COMPRESS_AGE_MASK;
+    return true;
+}
+
+
+static void compress_destroy(void) {
+    if (g_state == NULL)
+        return;
+
+    free(g_state->compress_ages);
+    g_state->compress_ages = NULL;
+    g_state->compress_ages_count = 0;
+}
+
+#else
+
+bool rm_set_compression(uint32_t cold_after) {
+    return cold_after == 0;
+}
+
+
+static void compress_forget(rm_header_t *h) {
+    (void)h;
+}
+
+
+#if RMALLOC_DEDUP
+static uint8_t *compress_age(rm_header_t *h) {
+    (void)h;
+    return NULL;
+}
+#endif
+
+
+static bool compress_touch(rm_header_t *h) {
+    (void)h;
+    return true;
+}
+
+
+static void compress_cold(uint64_t start_time, uint32_t maxtime) {
+    (void)start_time;
+    (void)maxtime;
+}
+
+
+static void compress_destroy(void) {
+}
+
+#endif // RMALLOC_COMPRESS
@@ -0,0 +1,534 @@
+/* compact_concurrent.c
+ *
+ * lock protocol for heaps used from several threads or processes, and the
+ * background compactor, see rm_compact_background_start().
+ *
+ * included from compact.c.
+ *
+ * in a concurrent heap, rm_header_t::lock_count is what decides whether a
+ * block can move, and it's only ever changed atomically:
+ *
+ * - rm_lock() increments it, unless it's RM_LOCK_MOVING. then the block is
+ *   being moved, and rm_lock() waits for the move to finish.
+ * - rm_unlock() decrements it.
+ * - rm_compact() claims each block right before moving it, by changing its
+ *   count from 0 to RM_LOCK_MOVING, and sets it back to 0 when the block is
+ *   in place.
+ *
+ * rm_header_t::type is only written under the mutex. rm_compact() derives it
+ * from the lock counts when it starts, and treats that as a hint: a block
+ * locked after that fails to be claimed, is marked locked and left where it
+ * is. rm_lock() on other blocks never waits for rm_compact(), nor for
+ * rm_compact_trim(). the compactors that plan every move up front (copying,
+ * locality, parallel and the pinned zone) can't do that, they claim all
+ * unlocked blocks with concurrent_claim_all() and hold them for the pass.
+ *
+ * malloc, free and compact are serialized by g_state->mutex.
+ *
+ * pinning, see rm_pin(), leaves the header alone. each thread has a small
+ * set of pinned handles per heap, and rm_compact() treats every block
+ * pinned in its heap as locked. rm_pin() publishes the handle in its set
+ * and then checks that the block isn't being moved, while rm_compact()
+ * claims a block and then checks the pin sets. with sequentially consistent ordering on both sides, at
+ * least one of them sees the other and backs off.
+ */
+
+#if RMALLOC_CONCURRENT
+
+#include <errno.h>
+#include <sched.h>
+
+typedef struct pin_set_t {
+    rm_header_t *pinned[RM_PIN_SET_SIZE]; // NULL if the slot is free
+    rmalloc_meta_t *state; // heap of the pinned handles
+    bool owned; // false once the owning thread has exited, set can be reused
+    struct pin_set_t *next;
+    struct pin_set_t *thread_next; // the owning thread's sets for other heaps
+} pin_set_t;
+
+static __thread pin_set_t *t_pin_sets = NULL;
+
+// all sets, never freed since a thread may hold on to its set
+static pin_set_t *g_pin_sets = NULL;
+static pthread_mutex_t g_pin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_pin_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_pin_key;
+
+static pthread_t g_background_thread;
+static bool g_background_running = false;
+static bool g_background_stopping = false;
+static uint32_t g_background_interval = 0;
+static uint32_t g_background_maxtime = 0;
+
+
+static void heap_mutex_init(bool process_shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (process_shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(&g_state->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+static void heap_mutex_lock(void) {
+    if (pthread_mutex_lock(&g_state->mutex) == EOWNERDEAD) {
+        // a process died in malloc, free or compact. nothing better to do
+        // than to carry on.
+        pthread_mutex_consistent(&g_state->mutex);
+    }
+}
+
+
+static void heap_mutex_unlock(void) {
+    pthread_mutex_unlock(&g_state->mutex);
+}
+
+
+static void concurrent_lock(rm_header_t *h) {
+    uint16_t count = __atomic_load_n(&h->lock_count, __ATOMIC_RELAXED);
+    for (;;) {
+        if (count == RM_LOCK_MOVING) {
+            // being moved. it's a single memmove, wait it out.
+            sched_yield();
+            count = __atomic_load_n(&h->lock_count, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&h->lock_count, &count, count + 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+
+static void concurrent_unlock(rm_header_t *h) {
+    uint16_t count = __atomic_load_n(&h->lock_count, __ATOMIC_RELAXED);
+    while (count > 0 && count != RM_LOCK_MOVING
+           && !__atomic_compare_exchange_n(&h->lock_count, &count, count - 1, true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/* take the mutex and derive the block types, used by the rest of
+ * rm_compact(), from the lock counts.
+ */
+static void concurrent_compact_begin(void) {
+    heap_mutex_lock();
+
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE)
+            continue;
+
+        h->type = __atomic_load_n(&h->lock_count, __ATOMIC_ACQUIRE) > 0 ? BLOCK_TYPE_LOCKED : BLOCK_TYPE_UNLOCKED;
+    }
+}
+
+
+static void concurrent_compact_end(void) {
+    heap_mutex_unlock();
+}
+
+
+/* mark pinned blocks that are being moved as locked. returns true if there
+ * were any.
+ */
+static bool pins_check_moving(void) {
+    bool found = false;
+
+    for (pin_set_t *set = __atomic_load_n(&g_pin_sets, __ATOMIC_ACQUIRE); set != NULL; set = set->next) {
+        if (__atomic_load_n(&set->state, __ATOMIC_ACQUIRE) != g_state)
+            continue;
+        for (int i=0; i<RM_PIN_SET_SIZE; i++) {
+            rm_header_t *h = __atomic_load_n(&set->pinned[i], __ATOMIC_SEQ_CST);
+            if (h != NULL && __atomic_load_n(&h->lock_count, __ATOMIC_RELAXED) == RM_LOCK_MOVING) {
+                h->type = BLOCK_TYPE_LOCKED;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+static void concurrent_release_range(rm_header_t *first, rm_header_t *last) {
+    rm_header_t *h = first;
+    for (;;) {
+        __atomic_store_n(&h->lock_count, 0, __ATOMIC_RELEASE);
+        if (h == last)
+            break;
+        h = h->next;
+    }
+}
+
+
+/* claim first..last for moving. stops at the first block that has been
+ * locked since concurrent_compact_begin(), marks it as locked and returns
+ * the last block claimed, or NULL if first itself was locked. *size is
+ * updated to the size of the claimed blocks.
+ */
+static rm_header_t *concurrent_claim_range(rm_header_t *first, rm_header_t *last, uint32_t *size) {
+    rm_header_t *claimed = NULL;
+    *size = 0;
+
+    for (rm_header_t *h = first; h != last->next; h = h->next) {
+        uint16_t unlocked = 0;
+        if (!__atomic_compare_exchange_n(&h->lock_count, &unlocked, RM_LOCK_MOVING, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            h->type = BLOCK_TYPE_LOCKED;
+            break;
+        }
+
+        claimed = h;
+        *size += h->size;
+    }
+
+    if (claimed == NULL || !pins_check_moving())
+        return claimed;
+
+    // some were pinned meanwhile. keep the blocks before the first of them.
+    rm_header_t *last_claimed = claimed;
+    rm_header_t *h = first;
+    claimed = NULL;
+    *size = 0;
+    for (;;) {
+        if (h->type == BLOCK_TYPE_LOCKED) {
+            concurrent_release_range(h, last_claimed);
+            break;
+        }
+
+        claimed = h;
+        *size += h->size;
+        if (h == last_claimed)
+            break;
+        h = h->next;
+    }
+
+    return claimed;
+}
+
+
+/* claim every unlocked block at once, for compactors that plan all moves
+ * up front. blocks locked or pinned meanwhile are marked as locked, the
+ * caller releases the rest when done.
+ */
+static void concurrent_claim_all(void) {
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        uint16_t unlocked = 0;
+        if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_UNLOCKED
+            && !__atomic_compare_exchange_n(&h->lock_count, &unlocked, RM_LOCK_MOVING, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            h->type = BLOCK_TYPE_LOCKED;
+    }
+
+    // pinned meanwhile, give them back
+    if (pins_check_moving()) {
+        for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+            uint16_t moving = RM_LOCK_MOVING;
+            if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_LOCKED)
+                __atomic_compare_exchange_n(&h->lock_count, &moving, 0, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/* switch a heap to the concurrent lock protocol. the lock counts are kept
+ * in plain heaps too, so there's nothing to convert.
+ */
+static void concurrent_enable(bool process_shared) {
+    heap_mutex_init(process_shared);
+    g_state->concurrent = true;
+}
+
+
+static void concurrent_disable(void) {
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE)
+            continue;
+
+        h->type = h->lock_count > 0 ? BLOCK_TYPE_LOCKED : BLOCK_TYPE_UNLOCKED;
+    }
+
+    g_state->concurrent = false;
+    pthread_mutex_destroy(&g_state->mutex);
+}
+
+
+static void pin_set_release(void *sets) {
+    for (pin_set_t *set = (pin_set_t *)sets; set != NULL; set = set->thread_next)
+        __atomic_store_n(&set->owned, false, __ATOMIC_RELEASE);
+}
+
+
+static void pin_key_create(void) {
+    pthread_key_create(&g_pin_key, pin_set_release);
+}
+
+
+/* the calling thread's set for the current heap, NULL if it has none */
+static pin_set_t *pin_set_find(void) {
+    pin_set_t *set = t_pin_sets;
+    while (set != NULL && set->state != g_state)
+        set = set->thread_next;
+    return set;
+}
+
+
+static pin_set_t *pin_set_acquire(void) {
+    pthread_once(&g_pin_key_once, pin_key_create);
+
+    pthread_mutex_lock(&g_pin_mutex);
+
+    pin_set_t *set = g_pin_sets;
+    while (set != NULL && __atomic_load_n(&set->owned, __ATOMIC_ACQUIRE))
+        set = set->next;
+
+    if (set == NULL) {
+        set = (pin_set_t *)calloc(1, sizeof(pin_set_t));
+        if (set != NULL) {
+            set->next = g_pin_sets;
+            __atomic_store_n(&g_pin_sets, set, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (set != NULL) {
+        // a set left by a thread that has exited has no pins
+        __atomic_store_n(&set->state, g_state, __ATOMIC_RELEASE);
+        set->owned = true;
+        set->thread_next = t_pin_sets;
+        t_pin_sets = set;
+        pthread_setspecific(g_pin_key, set);
+    }
+
+    pthread_mutex_unlock(&g_pin_mutex);
+
+    return set;
+}
+
+
+void *rm_pin(rm_handle_t h) {
+    rm_header_t *f = header_owner((rm_header_t *)h);
+
+    // other processes can't see this process' pin sets
+    if (g_state->shared)
+        return rm_lock(h);
+    if (g_state->compress_ages != NULL && !compress_touch(f))
+        return NULL;
+
+    pin_set_t *set = pin_set_find();
+    if (set == NULL && (set = pin_set_acquire()) == NULL)
+        return rm_lock(h);
+
+    int slot = 0;
+    while (slot < RM_PIN_SET_SIZE && set->pinned[slot] != NULL)
+        slot++;
+    if (slot == RM_PIN_SET_SIZE)
+        return rm_lock(h);
+
+    for (;;) {
+        __atomic_store_n(&set->pinned[slot], f, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&f->lock_count, __ATOMIC_SEQ_CST) != RM_LOCK_MOVING)
+            break;
+
+        // being moved, step aside until it's done
+        __atomic_store_n(&set->pinned[slot], NULL, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&f->lock_count, __ATOMIC_RELAXED) == RM_LOCK_MOVING)
+            sched_yield();
+    }
+
+    sample_access(f);
+    TRACE(RM_TRACE_LOCK, f, NULL, f->memory, f->size);
+
+    return f->memory;
+}
+
+
+void rm_unpin(rm_handle_t h) {
+    rm_header_t *f = header_owner((rm_header_t *)h);
+
+    pin_set_t *set = pin_set_find();
+    int slot = 0;
+    while (set != NULL && slot < RM_PIN_SET_SIZE && set->pinned[slot] != f)
+        slot++;
+
+    // not in the set, so it overflowed into a lock
+    if (set == NULL || slot == RM_PIN_SET_SIZE) {
+        rm_unlock(h);
+        return;
+    }
+
+    __atomic_store_n(&set->pinned[slot], NULL, __ATOMIC_RELEASE);
+
+    TRACE(RM_TRACE_UNLOCK, f, NULL, f->memory, f->size);
+}
+
+
+/* pinned blocks are locked for the duration of the compaction. only plain
+ * unlocked blocks are marked, so that pins_compact_end() can tell which to
+ * give back. the sets of other heaps are left alone, their headers may be
+ * in use by another compaction.
+ */
+static void pins_compact_begin(void) {
+    for (pin_set_t *set = __atomic_load_n(&g_pin_sets, __ATOMIC_ACQUIRE); set != NULL; set = set->next) {
+        if (__atomic_load_n(&set->state, __ATOMIC_ACQUIRE) != g_state)
+            continue;
+        for (int i=0; i<RM_PIN_SET_SIZE; i++) {
+            rm_header_t *h = __atomic_load_n(&set->pinned[i], __ATOMIC_SEQ_CST);
+            if (h != NULL && h->type == BLOCK_TYPE_UNLOCKED)
+                h->type = BLOCK_TYPE_LOCKED;
+        }
+    }
+}
+
+
+static void pins_compact_end(void) {
+    if (heap_concurrent())
+        return; // types are derived from the lock counts each time
+
+    for (pin_set_t *set = __atomic_load_n(&g_pin_sets, __ATOMIC_ACQUIRE); set != NULL; set = set->next) {
+        if (__atomic_load_n(&set->state, __ATOMIC_ACQUIRE) != g_state)
+            continue;
+        for (int i=0; i<RM_PIN_SET_SIZE; i++) {
+            rm_header_t *h = set->pinned[i];
+            if (h != NULL && h->type == BLOCK_TYPE_LOCKED && h->lock_count == 0)
+                h->type = BLOCK_TYPE_UNLOCKED;
+        }
+    }
+}
+
+
+static void *background_thread(void *arg) {
+    (void)arg;
+
+    struct timespec interval = {g_background_interval / 1000000000, g_background_interval % 1000000000};
+    while (!__atomic_load_n(&g_background_stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        rm_compact(g_background_maxtime);
+    }
+
+    return NULL;
+}
+
+
+bool rm_compact_background_start(uint32_t interval, uint32_t maxtime) {
+    if (g_background_running || g_state == NULL)
+        return false;
+
+    // shared heaps are concurrent already. compressed and spilled blocks
+    // can't be locked concurrently, see compact_compress.c
+    if (!rm_set_compression(0) || !rm_set_spill(NULL, 0))
+        return false;
+    if (!heap_concurrent())
+        concurrent_enable(/*process_shared*/false);
+
+    g_background_interval = interval;
+    g_background_maxtime = maxtime;
+    g_background_stopping = false;
+
+    if (pthread_create(&g_background_thread, NULL, background_thread, NULL) != 0) {
+        if (!g_state->shared)
+            concurrent_disable();
+        return false;
+    }
+
+    g_background_running = true;
+    return true;
+}
+
+
+void rm_compact_background_stop(void) {
+    if (!g_background_running)
+        return;
+
+    __atomic_store_n(&g_background_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(g_background_thread, NULL);
+    g_background_running = false;
+
+    if (!g_state->shared)
+        concurrent_disable();
+}
+
+#else
+
+static void heap_mutex_lock(void) {
+}
+
+
+static void heap_mutex_unlock(void) {
+}
+
+
+static void concurrent_lock(rm_header_t *h) {
+    (void)h;
+}
+
+
+static void concurrent_unlock(rm_header_t *h) {
+    (void)h;
+}
+
+
+static void concurrent_compact_begin(void) {
+}
+
+
+static void concurrent_compact_end(void) {
+}
+
+
+static void concurrent_claim_all(void) {
+}
+
+
+static bool pins_check_moving(void) {
+    return false;
+}
+
+
+static rm_header_t *concurrent_claim_range(rm_header_t *first, rm_header_t *last, uint32_t *size) {
+    (void)size;
+    (void)first;
+    return last;
+}
+
+
+static void concurrent_release_range(rm_header_t *first, rm_header_t *last) {
+    (void)first;
+    (void)last;
+}
+
+
+void *rm_pin(rm_handle_t h) {
+    return rm_lock(h);
+}
+
+
+void rm_unpin(rm_handle_t h) {
+    rm_unlock(h);
+}
+
+
+static void pins_compact_begin(void) {
+}
+
+
+static void pins_compact_end(void) {
+}
+
+
+bool rm_compact_background_start(uint32_t interval, uint32_t maxtime) {
+    (void)interval;
+    (void)maxtime;
+    return false;
+}
+
+
+void rm_compact_background_stop(void) {
+}
+
+#endif // RMALLOC_CONCURRENT
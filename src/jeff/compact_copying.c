@@ -0,0 +1,362 @@
+/* compact_copying.c
+ *
+ * copying compaction, see rm_compact_copying().
+ *
+ * included from compact.c.
+ *
+ * the live unlocked blocks are copied out to a to-space, in handle order,
+ * and then copied back from the bottom of the heap up, around the locked
+ * blocks, which stay where they are. free blocks are never visited, only
+ * the header table, the header list is rebuilt from the new layout.
+ *
+ * where each block goes is worked out before anything is copied (see
+ * copying_plan()). blocks that don't fit below a locked block leave a hole,
+ * so a new order can end higher than the old layout, into the header table
+ * of a full heap. such an order is given up for address order, which never
+ * ends higher.
+ *
+ * the header table shares the heap with the data, and handles are header
+ * addresses, so the heap can't simply flip to the to-space. copying back
+ * costs a second memcpy of the live data, but neither copy overlaps, and
+ * nothing depends on how many blocks have died.
+ *
+ * the to-space is kept for the next call, so that its pages are only
+ * faulted in once. rm_destroy() frees it.
+ *
+ * rm_compact_locality() is the same, but puts the blocks in the access
+ * sample ring (see sample_access()) first, in the order of their oldest
+ * sample, and the rest in address order. co-locked blocks are sampled close
+ * together, so that's where they end up.
+ *
+ * rm_compact() uses it to move blocks into the pinned zone, see
+ * compact_zone.c. otherwise the blocks of a group are kept together, see
+ * compact_group.c.
+ */
+
+#ifndef __BILLY__
+
+static int copying_compare_address(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)(*(rm_header_t **)a)->memory;
+    uintptr_t y = (uintptr_t)(*(rm_header_t **)b)->memory;
+    return x < y ? -1 : x > y;
+}
+
+
+/* a to-space of at least 'size' bytes. in shared heaps the pointer would
+ * only be good in one process, so those get a new one every time.
+ */
+static uint8_t *copying_to_space(size_t size) {
+    if (g_state->shared)
+        return (uint8_t *)malloc(size);
+
+    if (g_state->to_space_size < size) {
+        free(g_state->to_space);
+        g_state->to_space = malloc(size);
+        g_state->to_space_size = g_state->to_space != NULL ? size : 0;
+    }
+    return (uint8_t *)g_state->to_space;
+}
+
+
+static void copying_destroy(void) {
+    if (g_state == NULL || g_state->shared)
+        return;
+
+    free(g_state->to_space);
+    g_state->to_space = NULL;
+    g_state->to_space_size = 0;
+}
+
+
+/* move the sampled blocks in live[] to the front, in sample order. the
+ * rest keep their order.
+ */
+static void copying_order_by_samples(rm_header_t **live, uint32_t live_count) {
+    if (g_state->samples == NULL)
+        return;
+
+    uint32_t header_count = g_state->header_top - g_state->header_bottom + 1;
+    uint32_t *rank = (uint32_t *)calloc(header_count, sizeof(uint32_t));
+    rm_header_t **ordered = (rm_header_t **)calloc(RM_SAMPLE_COUNT + live_count + 1, sizeof(rm_header_t *));
+    if (rank == NULL || ordered == NULL) {
+        free(rank);
+        free(ordered);
+        return;
+    }
+
+    // oldest first
+    uint32_t next = g_state->sample_next;
+    uint32_t first = next > RM_SAMPLE_COUNT ? next - RM_SAMPLE_COUNT : 0;
+    uint32_t ranked = 0;
+    for (uint32_t i = first; i < next; i++) {
+        uint32_t index = g_state->samples[i % RM_SAMPLE_COUNT];
+        if (index < header_count && rank[index] == 0)
+            rank[index] = ++ranked;
+    }
+
+    uint32_t rest = RM_SAMPLE_COUNT;
+    for (uint32_t i = 0; i < live_count; i++) {
+        uint32_t r = rank[g_state->header_top - live[i]];
+        if (r != 0)
+            ordered[r - 1] = live[i];
+        else
+            ordered[rest++] = live[i];
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < rest; i++) {
+        if (ordered[i] != NULL)
+            live[count++] = ordered[i];
+    }
+
+    free(rank);
+    free(ordered);
+}
+
+
+enum {
+    COPYING_ORDER_HANDLE = 0,
+    COPYING_ORDER_SAMPLES,
+    COPYING_ORDER_ZONE,
+};
+
+
+/* where the blocks in live[] go, packed in that order from the bottom of the
+ * heap up, around the locked blocks. a block that doesn't fit below the next
+ * locked block goes past it, and the hole is left empty. used[] gets all of
+ * them in address order. returns the end of the last block in live[].
+ */
+static uintptr_t copying_plan(rm_header_t **live, uint32_t live_count, rm_header_t **locked, uint32_t locked_count,
+                              uintptr_t *new_memory, rm_header_t **used, uint32_t *used_count) {
+    uintptr_t cursor = (uintptr_t)g_state->memory_bottom;
+    uint32_t count = 0, island = 0;
+    for (uint32_t i = 0; i < live_count; i++) {
+        rm_header_t *h = live[i];
+        while (island < locked_count && (uintptr_t)locked[island]->memory < cursor + h->size) {
+            used[count++] = locked[island];
+            uintptr_t end = (uintptr_t)locked[island]->memory + locked[island]->size;
+            if (end > cursor)
+                cursor = end;
+            island++;
+        }
+
+        new_memory[i] = cursor;
+        used[count++] = h;
+        cursor += h->size;
+    }
+    while (island < locked_count)
+        used[count++] = locked[island++];
+
+    *used_count = count;
+    return cursor;
+}
+
+
+/* the compaction itself, on a heap the caller has already claimed for
+ * compacting, see copying_compact(). false if it couldn't, and then nothing
+ * has moved.
+ */
+static bool copying_run(int order) {
+    // handle order, which is allocation order until headers are reused
+    uint32_t live_count = 0, locked_count = 0;
+    uint64_t live_size = 0;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        STATS_COMPACT_VISITED;
+        if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE || h->type == BLOCK_TYPE_ALIAS)
+            continue;
+
+        if (h->type == BLOCK_TYPE_UNLOCKED) {
+            live_count++;
+            live_size += h->size;
+        } else {
+            locked_count++;
+        }
+    }
+
+    rm_header_t **used = (rm_header_t **)malloc(sizeof(rm_header_t *) * (live_count + locked_count + 1));
+    rm_header_t **live = (rm_header_t **)malloc(sizeof(rm_header_t *) * (live_count + 1));
+    rm_header_t **locked = (rm_header_t **)malloc(sizeof(rm_header_t *) * (locked_count + 1));
+    void **old_memory = (void **)malloc(sizeof(void *) * (live_count + 1));
+    uintptr_t *new_memory = (uintptr_t *)malloc(sizeof(uintptr_t) * (live_count + 1));
+    uint8_t *to_space = copying_to_space(live_size + 1);
+
+    bool ok = used != NULL && live != NULL && locked != NULL && old_memory != NULL && new_memory != NULL &&
+              to_space != NULL;
+    uint32_t used_count = 0;
+    if (ok) {
+        live_count = locked_count = 0;
+        for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+            if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE || h->type == BLOCK_TYPE_ALIAS)
+                continue;
+
+            if (h->type == BLOCK_TYPE_UNLOCKED)
+                live[live_count++] = h;
+            else
+                locked[locked_count++] = h;
+        }
+        qsort(locked, locked_count, sizeof(rm_header_t *), copying_compare_address);
+
+        // unsampled and cold blocks stay in address order, as rm_compact()
+        // leaves them
+        if (order != COPYING_ORDER_HANDLE)
+            qsort(live, live_count, sizeof(rm_header_t *), copying_compare_address);
+        if (order == COPYING_ORDER_SAMPLES) {
+            copying_order_by_samples(live, live_count);
+            __atomic_store_n(&g_state->sample_next, 0, __ATOMIC_RELAXED);
+        } else if (order == COPYING_ORDER_ZONE) {
+            zone_order(live, live_count);
+        }
+        if (order != COPYING_ORDER_ZONE)
+            group_gather(live, live_count);
+
+        // holes left below locked blocks can make any other order take more
+        // room than there was. address order never does, every block fits
+        // where it was if not lower.
+        uintptr_t end = copying_plan(live, live_count, locked, locked_count, new_memory, used, &used_count);
+        if (end > (uintptr_t)g_state->memory_top) {
+            qsort(live, live_count, sizeof(rm_header_t *), copying_compare_address);
+            end = copying_plan(live, live_count, locked, locked_count, new_memory, used, &used_count);
+        }
+        ok = end <= (uintptr_t)g_state->memory_top;
+    }
+
+    if (ok) {
+        // out to the to-space
+        uint8_t *to = to_space;
+        for (uint32_t i = 0; i < live_count; i++) {
+            memcpy(to, live[i]->memory, live[i]->size);
+            old_memory[i] = live[i]->memory;
+            to += live[i]->size;
+        }
+
+        // and back
+        to = to_space;
+        for (uint32_t i = 0; i < live_count; i++) {
+            rm_header_t *h = live[i];
+            TRACE(RM_TRACE_MOVE, h, old_memory[i], (void *)new_memory[i], h->size);
+            memcpy((void *)new_memory[i], to, h->size);
+            h->memory = (void *)new_memory[i];
+            if (h->memory != old_memory[i]) {
+                STATS_COMPACT_MOVED(h->size);
+                block_moved(h, old_memory[i]);
+            }
+            to += h->size;
+        }
+
+        // the old free headers are all replaced
+        for (rm_header_t *h = g_state->header_root; h != NULL; ) {
+            rm_header_t *next = h->next;
+            if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_FREE)
+                header_set_unused(h);
+            h = next;
+        }
+
+        stitch_used_headers(used, used_count);
+        if (order == COPYING_ORDER_ZONE)
+            zone_set_top(used, used_count);
+
+        header_trim();
+
+        rebuild_free_block_slots();
+
+        if (g_state->hugepage)
+            hugepage_trim();
+    }
+
+    free(used);
+    free(live);
+    free(locked);
+    free(old_memory);
+    free(new_memory);
+    if (g_state->shared)
+        free(to_space);
+
+    return ok;
+}
+
+
+static void copying_release_claims(void) {
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        uint16_t moving = RM_LOCK_MOVING;
+        if (!rm_header_is_unused(h))
+            __atomic_compare_exchange_n(&h->lock_count, &moving, 0, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+
+static bool copying_compact(int order) {
+    STATS_DECL;
+    STATS_START;
+    STATS_COMPACT_START;
+
+    if (heap_concurrent())
+        concurrent_compact_begin();
+    pins_compact_begin();
+    if (heap_concurrent())
+        concurrent_claim_all();
+
+    bool ok = copying_run(order);
+
+    if (heap_concurrent())
+        copying_release_claims();
+    pins_compact_end();
+    if (heap_concurrent())
+        concurrent_compact_end();
+
+    STATS_END(RM_STATS_COMPACT);
+    STATS_COMPACT_END_NO_BUDGET;
+
+    return ok;
+}
+
+
+/* called by rm_compact() with the heap claimed for compacting. moves the hot
+ * blocks into the pinned zone if any need to go there, and tells whether it
+ * did.
+ */
+static bool copying_zone(void) {
+    if (!zone_update())
+        return false;
+
+    if (heap_concurrent())
+        concurrent_claim_all();
+    bool ok = copying_run(COPYING_ORDER_ZONE);
+    if (heap_concurrent())
+        copying_release_claims();
+
+    zone_decay();
+    return ok;
+}
+
+
+bool rm_compact_copying(void) {
+    return copying_compact(COPYING_ORDER_HANDLE);
+}
+
+
+bool rm_compact_locality(void) {
+    return copying_compact(COPYING_ORDER_SAMPLES);
+}
+
+#else
+
+bool rm_compact_copying(void) {
+    return false;
+}
+
+
+bool rm_compact_locality(void) {
+    return false;
+}
+
+
+static void copying_destroy(void) {
+}
+
+
+static bool copying_zone(void) {
+    return false;
+}
+
+#endif // __BILLY__
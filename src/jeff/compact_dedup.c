@@ -0,0 +1,337 @@
+/* compact_dedup.c
+ *
+ * sharing identical read-only blocks, see rm_mark_immutable().
+ *
+ * included from compact.c.
+ *
+ * rm_compact() hashes the blocks marked immutable that are neither locked
+ * nor pinned, and those of the same size and bytes are collapsed into one
+ * copy. the copy gets an internal header of its own, the owner, which is an
+ * ordinary unlocked block and moves like one. the handles become aliases:
+ * BLOCK_TYPE_ALIAS headers that aren't in the header list, with next
+ * pointing to the owner and next_unused to the owner's next alias. the
+ * owner's next_unused is its first alias.
+ *
+ * locking an alias locks the owner (see header_owner()). freeing one unlinks
+ * it from the owner's aliases, and the owner goes with the last one. in the
+ * header list, the owner takes the place of the first block of its kind, and
+ * the others are replaced by free headers for their memory. blocks marked
+ * later are collapsed into the owner if they match it.
+ *
+ * the marks are a byte per possible header, malloc()'ed, so not in shared
+ * heaps, and a reopened file heap forgets them. the aliases are in the
+ * headers, and stay. collapsing would need the blocks claimed, so it's left
+ * out in concurrent heaps, the aliases already there keep working.
+ */
+
+#define DEDUP_IMMUTABLE 0x01
+#define DEDUP_OWNER 0x02
+#define DEDUP_REPLACED 0x04 // by the header in its next_unused, in dedup_collapse()
+
+#if RMALLOC_DEDUP
+
+typedef struct dedup_entry_t {
+    uint64_t hash;
+    rm_header_t *h;
+} dedup_entry_t;
+
+
+static uint8_t *dedup_flag(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    return index < g_state->dedup_flags_count ? &g_state->dedup_flags[index] : NULL;
+}
+
+
+bool rm_mark_immutable(rm_handle_t handle) {
+    rm_header_t *h = (rm_header_t *)handle;
+    if (h->type == BLOCK_TYPE_ALIAS)
+        return true;
+    if (g_state->shared || heap_concurrent() || h->move_cb != 0)
+        return false;
+
+    if (g_state->dedup_flags == NULL) {
+        uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+        g_state->dedup_flags = (uint8_t *)calloc(count, 1);
+        if (g_state->dedup_flags == NULL)
+            return false;
+        g_state->dedup_flags_count = count;
+    }
+
+    uint8_t *flag = dedup_flag(h);
+    if (flag == NULL)
+        return false;
+    if (!(*flag & DEDUP_IMMUTABLE)) {
+        *flag |= DEDUP_IMMUTABLE;
+        g_state->dedup_pending++;
+    }
+    return true;
+}
+
+
+/* called by rm_free(). true if h was an alias, and is freed. */
+static bool dedup_free(rm_header_t *h) {
+    if (h->type != BLOCK_TYPE_ALIAS) {
+        uint8_t *flag = dedup_flag(h);
+        if (flag != NULL)
+            *flag = 0;
+        return false;
+    }
+
+    rm_header_t *owner = h->next;
+    rm_header_t **link = &owner->next_unused;
+    while (*link != h)
+        link = &(*link)->next_unused;
+    *link = h->next_unused;
+
+    h->type = BLOCK_TYPE_FREE;
+    header_set_unused(h);
+    g_state->header_used_count--;
+
+    if (owner->next_unused == NULL) {
+        uint8_t *flag = dedup_flag(owner);
+        if (flag != NULL)
+            *flag = 0;
+        zone_forget(owner);
+        compress_forget(owner);
+        block_free(owner);
+    }
+    return true;
+}
+
+
+static uint64_t dedup_hash(const uint8_t *p, uint32_t size) {
+    uint64_t hash = size;
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        hash = (hash ^ v) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+
+/* by hash and size, owners first, then in handle order */
+static int dedup_compare(const void *a, const void *b) {
+    const dedup_entry_t *x = (const dedup_entry_t *)a, *y = (const dedup_entry_t *)b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->h->size != y->h->size)
+        return x->h->size < y->h->size ? -1 : 1;
+    bool x_owner = *dedup_flag(x->h) & DEDUP_OWNER, y_owner = *dedup_flag(y->h) & DEDUP_OWNER;
+    if (x_owner != y_owner)
+        return x_owner ? -1 : 1;
+    return x->h > y->h ? -1 : x->h < y->h;
+}
+
+
+static bool dedup_candidate(rm_header_t *h) {
+    if (rm_header_is_unused(h) || h->type != BLOCK_TYPE_UNLOCKED)
+        return false;
+    uint8_t *flag = dedup_flag(h);
+    if (flag == NULL || !(*flag & (DEDUP_IMMUTABLE | DEDUP_OWNER)))
+        return false;
+    // the bytes aren't the block's
+    uint8_t *age = compress_age(h);
+    return age == NULL || !(*age & (COMPRESSED | SPILLED));
+}
+
+
+/* the aliases of 'from' go to 'to', and from's block is freed */
+static void dedup_merge_owner(rm_header_t *to, rm_header_t *from) {
+    rm_header_t *last = NULL;
+    for (rm_header_t *a = from->next_unused; a != NULL; a = a->next_unused) {
+        a->next = to;
+        last = a;
+    }
+    if (last != NULL) {
+        last->next_unused = to->next_unused;
+        to->next_unused = from->next_unused;
+    }
+
+    *dedup_flag(from) = 0;
+    zone_forget(from);
+    compress_forget(from);
+    block_free(from);
+}
+
+
+/* h is to become an alias of owner, which takes its place in the header list
+ * if it's new, and otherwise a free header for h's memory. false if there's
+ * no header to spare.
+ */
+static bool dedup_replace(rm_header_t *h, rm_header_t *owner) {
+    rm_header_t *r = owner;
+    if (rm_header_is_unused(owner)) {
+        owner->memory = h->memory;
+    } else if ((r = header_new(/*insert_in_list*/false)) != NULL) {
+        r->memory = h->memory;
+    } else {
+        return false;
+    }
+
+    r->size = h->size;
+    r->type = BLOCK_TYPE_UNLOCKED;
+    r->lock_count = 0;
+    r->move_cb = 0;
+    r->next_unused = NULL;
+    g_state->header_used_count++;
+
+    h->next_unused = r;
+    *dedup_flag(h) |= DEDUP_REPLACED;
+    return true;
+}
+
+
+/* called by rm_compact() before compacting, if blocks have been marked since
+ * the last time. collapses the identical ones, of those hashed before
+ * maxtime (if > 0) is up.
+ */
+static void dedup_collapse(uint64_t start_time, uint32_t maxtime) {
+    if (g_state->dedup_pending == 0 || heap_concurrent())
+        return;
+
+    uint32_t count = 0;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (dedup_candidate(h))
+            count++;
+    }
+
+    dedup_entry_t *entries = (dedup_entry_t *)malloc(sizeof(dedup_entry_t) * (count + 1));
+    rm_header_t **owners = (rm_header_t **)calloc(count + 1, sizeof(rm_header_t *));
+    if (entries == NULL || owners == NULL) {
+        free(entries);
+        free(owners);
+        return;
+    }
+
+    // locked ones, and those left when the time is up, are tried again next
+    // time
+    uint32_t pending = 0;
+    bool done = false;
+    count = 0;
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (!done && dedup_candidate(h)) {
+            entries[count].hash = dedup_hash((const uint8_t *)h->memory, h->size);
+            entries[count++].h = h;
+            done = maxtime > 0 && uptime_nanoseconds() - start_time >= maxtime;
+        } else if (!rm_header_is_unused(h) && h->type != BLOCK_TYPE_ALIAS) {
+            uint8_t *flag = dedup_flag(h);
+            if (flag != NULL && (*flag & DEDUP_IMMUTABLE))
+                pending++;
+        }
+    }
+    qsort(entries, count, sizeof(dedup_entry_t), dedup_compare);
+
+    uint32_t replaced = 0;
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t end = i + 1;
+        while (end < count && entries[end].hash == entries[i].hash && entries[end].h->size == entries[i].h->size)
+            end++;
+
+        // a new owner for the first block, unless it's an owner already
+        rm_header_t *first = entries[i].h, *owner = NULL;
+        if (*dedup_flag(first) & DEDUP_OWNER)
+            owner = first;
+
+        for (uint32_t j = i + 1; j < end; j++) {
+            rm_header_t *h = entries[j].h;
+            if (memcmp(first->memory, h->memory, h->size) != 0)
+                continue;
+
+            if (owner == NULL) {
+                owner = header_new(/*insert_in_list*/false);
+                if (owner == NULL)
+                    break;
+                if (!dedup_replace(first, owner)) {
+                    header_set_unused(owner);
+                    owner = NULL;
+                    break;
+                }
+                owners[i] = owner;
+                replaced++;
+            }
+
+            if (*dedup_flag(h) & DEDUP_OWNER) {
+                dedup_merge_owner(owner, h);
+            } else if (dedup_replace(h, owner)) {
+                owners[j] = owner;
+                replaced++;
+            }
+        }
+        i = end;
+    }
+
+    if (replaced > 0) {
+        for (rm_header_t **link = &g_state->header_root; *link != NULL; link = &(*link)->next) {
+            rm_header_t *h = *link;
+            uint8_t *flag = dedup_flag(h);
+            if (flag != NULL && (*flag & DEDUP_REPLACED)) {
+                h->next_unused->next = h->next;
+                *link = h->next_unused;
+            }
+        }
+
+        // backwards, so that the oldest handles come first in the owners'
+        // aliases, and freeing in allocation order doesn't walk them
+        for (uint32_t i = count; i-- > 0; ) {
+            rm_header_t *h = entries[i].h, *owner = owners[i];
+            if (owner == NULL)
+                continue;
+
+            if (h->next_unused != owner)
+                block_free(h->next_unused);
+            *dedup_flag(owner) = DEDUP_OWNER;
+            *dedup_flag(h) = 0;
+            tag_charge(h, -(int64_t)h->size);
+
+            h->type = BLOCK_TYPE_ALIAS;
+            h->next = owner;
+            h->next_unused = owner->next_unused;
+            owner->next_unused = h;
+        }
+    }
+
+    g_state->dedup_pending = pending;
+    free(entries);
+    free(owners);
+}
+
+
+static void dedup_destroy(void) {
+    if (g_state == NULL)
+        return;
+
+    free(g_state->dedup_flags);
+    g_state->dedup_flags = NULL;
+    g_state->dedup_flags_count = 0;
+    g_state->dedup_pending = 0;
+}
+
+#else
+
+bool rm_mark_immutable(rm_handle_t handle) {
+    (void)handle;
+    return false;
+}
+
+
+static bool dedup_free(rm_header_t *h) {
+    (void)h;
+    return false;
+}
+
+
+static void dedup_collapse(uint64_t start_time, uint32_t maxtime) {
+    (void)start_time;
+    (void)maxtime;
+}
+
+
+static void dedup_destroy(void) {
+}
+
+#endif // RMALLOC_DEDUP
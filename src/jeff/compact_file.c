@@ -0,0 +1,359 @@
+/* compact_file.c
+ *
+ * file-backed persistent heap, see rm_init_file(), and heap shared between
+ * processes, see rm_init_shared().
+ *
+ * included from compact.c.
+ *
+ * file layout:
+ * [rm_file_header_t, padded to a page | heap of 'size' bytes]
+ *
+ * the allocator state (rmalloc_meta_t) lives in the file header, so the heap
+ * is reopened just by mapping the file. the mapping is first tried at the
+ * address it had last time, in which case nothing needs to be touched.
+ * otherwise, all pointers in the state and in the header table are rebased
+ * in one linear pass over the header table, and the free lists (which live
+ * in the free blocks) are rebuilt from the headers. no objects are moved or
+ * walked.
+ *
+ * handles are header addresses and change when the heap is rebased, store
+ * rm_handle_index() in the heap instead.
+ *
+ * a shared heap is a POSIX shared memory object with the same layout. it
+ * can't be rebased while other processes use it, so all processes map it at
+ * the address of the process that created it, and handles can be passed
+ * between processes as they are. the creator maps it at RM_SHARED_BASE (or
+ * the first free slot above it), where nothing else is mapped in a process
+ * that hasn't asked for it, whatever ASLR did. the others map it at the
+ * same address with MAP_FIXED_NOREPLACE, which fails rather than picking
+ * another address, or replacing a mapping that is already there.
+ *
+ * the mutex in the state is process-shared, and the lock protocol in
+ * compact_concurrent.c works the same between processes as between threads.
+ */
+
+#ifndef __BILLY__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RM_FILE_MAGIC "RMHEAP"
+#define RM_FILE_VERSION 11
+#define RM_FILE_PAGE_SIZE 4096
+
+typedef struct rm_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t heap_size;
+    uint64_t base; // address of the mapping when the file was last written
+    rmalloc_meta_t meta;
+} rm_file_header_t;
+
+#define RM_FILE_HEADER_SIZE ((sizeof(rm_file_header_t) + RM_FILE_PAGE_SIZE - 1) & ~(RM_FILE_PAGE_SIZE - 1))
+
+/* where shared heaps go. on 64-bit linux, that's above the program and its
+ * brk heap, and below the mmap area and the stack. 0 = wherever the kernel
+ * puts it, and other processes may have something else there.
+ */
+#ifndef RM_SHARED_BASE
+#if UINTPTR_MAX > 0xffffffffu
+#define RM_SHARED_BASE 0x200000000000ull
+#else
+#define RM_SHARED_BASE 0
+#endif
+#endif
+#define RM_SHARED_SLOTS 16
+#define RM_SHARED_SLOT_SIZE (1ull << 33) // more than the largest heap
+
+// older kernels take it as a hint, so the address is checked anyway
+#ifdef MAP_FIXED_NOREPLACE
+#define RM_MAP_NOREPLACE MAP_FIXED_NOREPLACE
+#else
+#define RM_MAP_NOREPLACE 0
+#endif
+
+
+#define REBASE(p, delta) { if ((p) != NULL) (p) = (__typeof__(p))((uint8_t *)(p) + (delta)); }
+
+static void file_rebase(rmalloc_meta_t *state, intptr_t delta) {
+    // header table first, while header_bottom/header_top still point into
+    // the old mapping
+    rm_header_t *h = (rm_header_t *)((uint8_t *)state->header_bottom + delta);
+    rm_header_t *top = (rm_header_t *)((uint8_t *)state->header_top + delta);
+    for (; h <= top; h++) {
+        REBASE(h->memory, delta);
+        REBASE(h->next, delta);
+#if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
+        REBASE(h->next_unused, delta);
+#endif
+    }
+
+    REBASE(state->memory_bottom, delta);
+    REBASE(state->memory_top, delta);
+    REBASE(state->free_block_slots, delta);
+    REBASE(state->header_top, delta);
+    REBASE(state->header_bottom, delta);
+    REBASE(state->header_root, delta);
+    REBASE(state->last_free_header, delta);
+    REBASE(state->unused_header_root, delta);
+    REBASE(state->highest_address_header, delta);
+}
+
+
+/* a reopened heap has nothing locked: the locks, the claims of a compaction
+ * and the mutex belonged to the process that wrote them, which may have
+ * crashed holding them. it's plain until made concurrent again.
+ */
+static void file_reset_locks(void) {
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (rm_header_is_unused(h))
+            continue;
+
+        h->lock_count = 0;
+        if (h->type == BLOCK_TYPE_LOCKED || h->type == BLOCK_TYPE_WEAK_LOCKED)
+            h->type = BLOCK_TYPE_UNLOCKED;
+    }
+
+    g_state->concurrent = false;
+    pthread_mutex_init(&g_state->mutex, NULL);
+}
+
+
+/* map a shared heap at 'address' and nowhere else */
+static void *file_map_exact(int fd, uint64_t address, size_t size) {
+    void *mapping = mmap((void *)(uintptr_t)address, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | RM_MAP_NOREPLACE, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    if ((uint64_t)(uintptr_t)mapping != address) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    return mapping;
+}
+
+
+/* map the file, at its previous address if possible. if 'exact' is set,
+ * the heap is shared: a new one goes to the first free slot from
+ * RM_SHARED_BASE, an existing one to its address, or fails.
+ */
+static void *file_map(int fd, uint32_t *size, bool *is_new, bool exact) {
+    struct stat st;
+    rm_file_header_t old;
+
+    if (fstat(fd, &st) != 0)
+        return NULL;
+
+    *is_new = st.st_size == 0;
+    if (*is_new) {
+        if (*size == 0 || ftruncate(fd, RM_FILE_HEADER_SIZE + *size) != 0)
+            return NULL;
+        old.base = 0;
+    } else {
+        if (pread(fd, &old, sizeof(old), 0) != sizeof(old)
+            || memcmp(old.magic, RM_FILE_MAGIC, sizeof(RM_FILE_MAGIC)) != 0
+            || old.version != RM_FILE_VERSION
+            || (*size != 0 && *size != old.heap_size)
+            || (uint64_t)st.st_size != RM_FILE_HEADER_SIZE + old.heap_size)
+            return NULL;
+        *size = old.heap_size;
+    }
+
+    if (exact && !*is_new)
+        return file_map_exact(fd, old.base, RM_FILE_HEADER_SIZE + *size);
+    for (int i = 0; exact && RM_SHARED_BASE != 0 && i < RM_SHARED_SLOTS; i++) {
+        void *mapping = file_map_exact(fd, RM_SHARED_BASE + i*RM_SHARED_SLOT_SIZE, RM_FILE_HEADER_SIZE + *size);
+        if (mapping != NULL)
+            return mapping;
+    }
+
+    // try to get the same address as last time, to avoid rebasing
+    void *mapping = mmap((void *)(uintptr_t)old.base, RM_FILE_HEADER_SIZE + *size,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    return mapping;
+}
+
+
+bool rm_init_file(const char *path, uint32_t size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+
+    bool is_new = false;
+    void *mapping = file_map(fd, &size, &is_new, /*exact*/false);
+    close(fd);
+
+    if (mapping == NULL)
+        return false;
+
+    rm_file_header_t *header = (rm_file_header_t *)mapping;
+    g_heap_state = &header->meta;
+
+    if (is_new) {
+        memcpy(header->magic, RM_FILE_MAGIC, sizeof(RM_FILE_MAGIC));
+        header->version = RM_FILE_VERSION;
+        header->heap_size = size;
+
+        // the file is already zero-filled
+        heap_init((uint8_t *)mapping + RM_FILE_HEADER_SIZE, size);
+    } else {
+        // function addresses and malloc() memory are only good for the
+        // process that wrote them
+        memset(g_state->move_cbs, 0, sizeof(g_state->move_cbs));
+        g_state->oom_handler = NULL;
+        g_state->oom_arg = NULL;
+        g_state->to_space = NULL;
+        g_state->to_space_size = 0;
+        g_state->sample_every = 0;
+        g_state->samples = NULL;
+        g_state->lock_scores = NULL;
+        g_state->lock_scores_count = 0;
+        g_state->groups = NULL;
+        g_state->group_ids = NULL;
+        g_state->group_ids_count = 0;
+        g_state->compress_ages = NULL;
+        g_state->compress_ages_count = 0;
+        g_state->spill_fd = -1;
+        g_state->spill_holes = NULL;
+        g_state->dedup_flags = NULL;
+        g_state->dedup_flags_count = 0;
+        g_state->dedup_pending = 0;
+        g_state->generations = NULL;
+        g_state->generations_count = 0;
+        g_state->tags = NULL;
+        g_state->tags_count = 0;
+        memset(g_state->tag_bytes, 0, sizeof(g_state->tag_bytes));
+        memset(g_state->tag_handles, 0, sizeof(g_state->tag_handles));
+        memset(g_state->tag_limits, 0, sizeof(g_state->tag_limits));
+        memset(g_state->tag_limit_cbs, 0, sizeof(g_state->tag_limit_cbs));
+        memset(g_state->tag_limit_args, 0, sizeof(g_state->tag_limit_args));
+
+        if ((uint64_t)(uintptr_t)mapping != header->base) {
+            file_rebase(g_state, (intptr_t)((uintptr_t)mapping - header->base));
+            rebuild_free_block_slots();
+        }
+        file_reset_locks();
+    }
+
+    header->base = (uint64_t)(uintptr_t)mapping;
+    g_state->mapping = mapping;
+    g_state->mapping_size = RM_FILE_HEADER_SIZE + size;
+
+    return true;
+}
+
+
+#if RMALLOC_CONCURRENT
+
+bool rm_init_shared(const char *name, uint32_t size) {
+    // the creator is the one process that gets to create the object
+    int fd = shm_open(name, size > 0 ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    bool is_new = false;
+    void *mapping = file_map(fd, &size, &is_new, /*exact*/true);
+    close(fd);
+
+    if (mapping == NULL)
+        return false;
+
+    rm_file_header_t *header = (rm_file_header_t *)mapping;
+
+    if (is_new) {
+        header->version = RM_FILE_VERSION;
+        header->heap_size = size;
+        header->base = (uint64_t)(uintptr_t)mapping;
+
+        g_heap_state = &header->meta;
+        heap_init((uint8_t *)mapping + RM_FILE_HEADER_SIZE, size);
+        concurrent_enable(/*process_shared*/true);
+        g_state->shared = true;
+
+        // the magic is written last, attaching fails until the heap is ready
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header->magic, RM_FILE_MAGIC, sizeof(RM_FILE_MAGIC));
+    } else {
+        if (!header->meta.shared) {
+            munmap(mapping, RM_FILE_HEADER_SIZE + size);
+            return false;
+        }
+        g_heap_state = &header->meta;
+    }
+
+    // mapping and mapping_size are the same in all processes
+    g_state->mapping = mapping;
+    g_state->mapping_size = RM_FILE_HEADER_SIZE + size;
+
+    return true;
+}
+
+#else
+
+// other processes need the lock protocol in compact_concurrent.c
+bool rm_init_shared(const char *name, uint32_t size) {
+    (void)name;
+    (void)size;
+    return false;
+}
+
+#endif // RMALLOC_CONCURRENT
+
+
+bool rm_sync(void) {
+    if (g_state == NULL || g_state->mapping == NULL)
+        return false;
+
+    return msync(g_state->mapping, g_state->mapping_size, MS_SYNC) == 0;
+}
+
+
+static void file_destroy(void) {
+    if (g_state == NULL || g_state->mapping == NULL)
+        return;
+
+    void *mapping = g_state->mapping;
+    size_t mapping_size = g_state->mapping_size;
+
+    // other processes still use a shared heap's state
+    if (!g_state->shared) {
+        g_state->mapping = NULL;
+        g_state->mapping_size = 0;
+    }
+    g_heap_state = NULL;
+
+    msync(mapping, mapping_size, MS_SYNC);
+    munmap(mapping, mapping_size);
+}
+
+#else
+
+bool rm_init_file(const char *path, uint32_t size) {
+    (void)path;
+    (void)size;
+    return false;
+}
+
+
+bool rm_init_shared(const char *name, uint32_t size) {
+    (void)name;
+    (void)size;
+    return false;
+}
+
+
+bool rm_sync(void) {
+    return false;
+}
+
+
+static void file_destroy(void) {
+}
+
+#endif // __BILLY__
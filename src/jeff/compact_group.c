@@ -0,0 +1,362 @@
+/* compact_group.c
+ *
+ * handle groups, see rm_group_create().
+ *
+ * included from compact.c.
+ *
+ * each group has a chunk, an ordinary unlocked block that rm_group_malloc()
+ * carves the members off the bottom of, each with a header of its own. the
+ * members of a chunk are thus next to each other, followed by what's left of
+ * the chunk. when the chunk is too small for the next member, the rest is
+ * freed and a new chunk allocated. the last member gets the chunk's own
+ * header if the rest would be too small for a free block.
+ *
+ * sliding keeps address order, so rm_compact() moves a chunk's members as
+ * one run. the copying compactions put a group's blocks together, at the
+ * place of the first one (see group_gather()).
+ *
+ * the handle indices of the members are kept in a list per group, for
+ * rm_group_free(), and their group id in a table of one byte per possible
+ * header. rm_free() clears the id, so a member freed on its own and whose
+ * header is reused isn't freed again by rm_group_free(). the list is pruned
+ * when it's grown to twice the live members.
+ *
+ * both are malloc()'ed, so not in shared heaps, and a reopened file heap
+ * forgets its groups. the blocks stay allocated.
+ */
+
+#if RMALLOC_GROUPS
+
+static uint8_t group_id(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    return index < g_state->group_ids_count ? g_state->group_ids[index] : 0;
+}
+
+
+static void group_set_id(rm_header_t *h, uint8_t id) {
+    uint32_t index = g_state->header_top - h;
+    if (index < g_state->group_ids_count)
+        g_state->group_ids[index] = id;
+}
+
+
+/* a member is freed on its own */
+static void group_forget(rm_header_t *h) {
+    uint8_t id = group_id(h);
+    if (id != 0) {
+        g_state->groups[id - 1].live--;
+        group_set_id(h, 0);
+    }
+}
+
+
+/* drop the members that have been freed since they were added */
+static void group_prune(rm_group_slot_t *slot, uint8_t id) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < slot->count; i++) {
+        if (g_state->group_ids[slot->members[i]] == id)
+            slot->members[count++] = slot->members[i];
+    }
+    slot->count = count;
+}
+
+
+static bool group_add(rm_group_slot_t *slot, uint8_t id, rm_header_t *h) {
+    if (slot->count == slot->capacity) {
+        if (slot->live * 2 < slot->count)
+            group_prune(slot, id);
+    }
+    if (slot->count == slot->capacity) {
+        uint32_t capacity = slot->capacity > 0 ? slot->capacity * 2 : 16;
+        uint32_t *members = (uint32_t *)realloc(slot->members, sizeof(uint32_t) * capacity);
+        if (members == NULL)
+            return false;
+        slot->members = members;
+        slot->capacity = capacity;
+    }
+
+    slot->members[slot->count++] = g_state->header_top - h;
+    slot->live++;
+    group_set_id(h, id);
+    return true;
+}
+
+
+rm_group_t rm_group_create(uint32_t chunk_size) {
+    if (g_state->shared)
+        return 0;
+    if (chunk_size == 0)
+        chunk_size = RM_GROUP_CHUNK_SIZE;
+    if (chunk_size < sizeof(free_memory_block_t))
+        chunk_size = sizeof(free_memory_block_t);
+
+    if (heap_concurrent())
+        heap_mutex_lock();
+
+    rm_group_t group = 0;
+    if (g_state->groups == NULL) {
+        uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+        g_state->groups = (rm_group_slot_t *)calloc(RM_GROUP_COUNT, sizeof(rm_group_slot_t));
+        g_state->group_ids = (uint8_t *)calloc(count, 1);
+        if (g_state->groups != NULL && g_state->group_ids != NULL) {
+            g_state->group_ids_count = count;
+        } else {
+            free(g_state->groups);
+            free(g_state->group_ids);
+            g_state->groups = NULL;
+            g_state->group_ids = NULL;
+        }
+    }
+
+    if (g_state->groups != NULL) {
+        for (uint32_t i = 0; i < RM_GROUP_COUNT; i++) {
+            if (g_state->groups[i].chunk_size == 0) {
+                g_state->groups[i].chunk_size = chunk_size;
+                group = i + 1;
+                break;
+            }
+        }
+    }
+
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    return group;
+}
+
+
+static rm_group_slot_t *group_slot(rm_group_t group) {
+    if (g_state->groups == NULL || group == 0 || group > RM_GROUP_COUNT)
+        return NULL;
+    rm_group_slot_t *slot = &g_state->groups[group - 1];
+    return slot->chunk_size != 0 ? slot : NULL;
+}
+
+
+static rm_header_t *group_block_new(rm_group_slot_t *slot, uint8_t id, uint32_t size) {
+    if (size < sizeof(free_memory_block_t))
+        size = sizeof(free_memory_block_t);
+    if (size > slot->chunk_size)
+        return block_new(size);
+
+    rm_header_t *chunk = slot->chunk;
+    if (chunk != NULL && chunk->size < size) {
+        group_set_id(chunk, 0);
+        block_free(chunk);
+        chunk = slot->chunk = NULL;
+    }
+    if (chunk == NULL) {
+        chunk = block_new(slot->chunk_size);
+        if (chunk == NULL)
+            return block_new(size);
+        group_set_id(chunk, id);
+        slot->chunk = chunk;
+    }
+
+    if (chunk->size - size < sizeof(free_memory_block_t)) {
+        slot->chunk = NULL;
+        return chunk;
+    }
+
+    rm_header_t *h = header_new(/*insert_in_list*/true);
+    if (h == NULL)
+        return NULL;
+
+    h->memory = chunk->memory;
+    h->size = size;
+    h->type = BLOCK_TYPE_UNLOCKED;
+    h->move_cb = 0;
+    g_state->header_used_count++;
+
+    chunk->memory = (uint8_t *)chunk->memory + size;
+    chunk->size -= size;
+    return h;
+}
+
+
+rm_handle_t rm_group_malloc(rm_group_t group, int size) {
+    STATS_DECL;
+    STATS_START;
+    if (heap_concurrent())
+        heap_mutex_lock();
+
+    rm_header_t *h = NULL;
+    rm_group_slot_t *slot = group_slot(group);
+    if (slot != NULL && size >= 0) {
+        h = group_block_new(slot, group, size);
+        if (h != NULL && !group_add(slot, group, h)) {
+            group_set_id(h, 0);
+            block_free(h);
+            h = NULL;
+        }
+    }
+
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    STATS_END(RM_STATS_MALLOC);
+
+    if (h != NULL) {
+        TRACE(RM_TRACE_MALLOC, h, NULL, h->memory, h->size);
+    }
+    return (rm_handle_t)h;
+}
+
+
+void rm_group_free(rm_group_t group) {
+    STATS_DECL;
+    STATS_START;
+    if (heap_concurrent())
+        heap_mutex_lock();
+
+    rm_group_slot_t *slot = group_slot(group);
+    if (slot != NULL) {
+        for (uint32_t i = 0; i < slot->count; i++) {
+            uint32_t index = slot->members[i];
+            // cleared first, a reused index can be in the list twice
+            if (g_state->group_ids[index] != group)
+                continue;
+            g_state->group_ids[index] = 0;
+
+            rm_header_t *h = g_state->header_top - index;
+            zone_forget(h);
+            compress_forget(h);
+            index_forget(h);
+            if (!dedup_free(h))
+                block_free(h);
+        }
+
+        if (slot->chunk != NULL) {
+            group_set_id(slot->chunk, 0);
+            block_free(slot->chunk);
+        }
+
+        free(slot->members);
+        memset(slot, 0, sizeof(rm_group_slot_t));
+    }
+
+    if (heap_concurrent())
+        heap_mutex_unlock();
+    STATS_END(RM_STATS_FREE);
+}
+
+
+#if RMALLOC_COMPRESS
+/* the chunk isn't a member, and mustn't be touched but by rm_group_malloc() */
+static bool group_is_chunk(rm_header_t *h) {
+    uint8_t id = group_id(h);
+    return id != 0 && g_state->groups[id - 1].chunk == h;
+}
+#endif
+
+
+/* move the blocks of each group in live[] to where its first block is. the
+ * rest keep their order.
+ */
+static void group_gather(rm_header_t **live, uint32_t live_count) {
+    if (g_state->group_ids == NULL)
+        return;
+
+    uint32_t start[RM_GROUP_COUNT];
+    memset(start, 0, sizeof(start));
+    uint32_t grouped_count = 0;
+    for (uint32_t i = 0; i < live_count; i++) {
+        uint8_t id = group_id(live[i]);
+        if (id != 0) {
+            start[id - 1]++;
+            grouped_count++;
+        }
+    }
+    if (grouped_count == 0)
+        return;
+
+    rm_header_t **grouped = (rm_header_t **)malloc(sizeof(rm_header_t *) * (grouped_count + live_count + 1));
+    if (grouped == NULL)
+        return;
+    rm_header_t **ordered = grouped + grouped_count;
+
+    // start[id - 1] is where the group begins in grouped[], start[id] where
+    // it ends once filled
+    uint32_t offset = 0;
+    for (uint32_t id = 0; id < RM_GROUP_COUNT; id++) {
+        uint32_t count = start[id];
+        start[id] = offset;
+        offset += count;
+    }
+    for (uint32_t i = 0; i < live_count; i++) {
+        uint8_t id = group_id(live[i]);
+        if (id != 0)
+            grouped[start[id - 1]++] = live[i];
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < live_count; i++) {
+        uint8_t id = group_id(live[i]);
+        if (id == 0) {
+            ordered[count++] = live[i];
+        } else if (live[i] == grouped[id > 1 ? start[id - 2] : 0]) {
+            // the group's first block, the whole group goes here
+            for (uint32_t j = id > 1 ? start[id - 2] : 0; j < start[id - 1]; j++)
+                ordered[count++] = grouped[j];
+        }
+    }
+    memcpy(live, ordered, sizeof(rm_header_t *) * live_count);
+
+    free(grouped);
+}
+
+
+static void group_destroy(void) {
+    if (g_state == NULL || g_state->shared || g_state->groups == NULL)
+        return;
+
+    for (uint32_t i = 0; i < RM_GROUP_COUNT; i++)
+        free(g_state->groups[i].members);
+    free(g_state->groups);
+    free(g_state->group_ids);
+    g_state->groups = NULL;
+    g_state->group_ids = NULL;
+    g_state->group_ids_count = 0;
+}
+
+#else
+
+rm_group_t rm_group_create(uint32_t chunk_size) {
+    (void)chunk_size;
+    return 0;
+}
+
+
+rm_handle_t rm_group_malloc(rm_group_t group, int size) {
+    (void)group;
+    (void)size;
+    return NULL;
+}
+
+
+void rm_group_free(rm_group_t group) {
+    (void)group;
+}
+
+
+static void group_forget(rm_header_t *h) {
+    (void)h;
+}
+
+
+#if RMALLOC_COMPRESS
+static bool group_is_chunk(rm_header_t *h) {
+    (void)h;
+    return false;
+}
+#endif
+
+
+static void group_gather(rm_header_t **live, uint32_t live_count) {
+    (void)live;
+    (void)live_count;
+}
+
+
+static void group_destroy(void) {
+}
+
+#endif // RMALLOC_GROUPS
@@ -0,0 +1,251 @@
+/* compact_hugepage.c
+ *
+ * heap backed by huge pages, see rm_init_hugepage().
+ *
+ * included from compact.c.
+ *
+ * the heap is an anonymous mapping aligned to RM_HUGEPAGE_SIZE, using
+ * MAP_HUGETLB if the system has huge pages reserved, and transparent huge
+ * pages (MADV_HUGEPAGE) otherwise.
+ *
+ * a huge page can only be given back whole, without splitting it, if nothing
+ * in its 2 MB is in use. so before sliding, rm_compact() tries to empty the
+ * topmost region: if every block in it is unlocked, and they all fit in free
+ * blocks below it, they're copied there. the usual pruning at the end of
+ * rm_compact() then lowers memory_top below the region, and hugepage_trim()
+ * releases every whole region between memory_top and the headers. partial
+ * regions are never released.
+ */
+
+#ifndef __BILLY__
+
+#include <sys/mman.h>
+
+#define HUGEPAGE_ROUND_DOWN(p) ((uintptr_t)(p) & ~(uintptr_t)(RM_HUGEPAGE_SIZE - 1))
+#define HUGEPAGE_ROUND_UP(p) HUGEPAGE_ROUND_DOWN((uintptr_t)(p) + RM_HUGEPAGE_SIZE - 1)
+
+
+static void *hugepage_map(size_t size) {
+#ifdef MAP_HUGETLB
+    // huge pages from the reserved pool are always aligned
+    void *reserved = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (reserved != MAP_FAILED)
+        return reserved;
+#endif
+
+    // map one huge page extra and cut off the ends to get the alignment
+    uint8_t *over = (uint8_t *)mmap(NULL, size + RM_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (over == MAP_FAILED)
+        return NULL;
+
+    uint8_t *mapping = (uint8_t *)HUGEPAGE_ROUND_UP(over);
+    if (mapping > over)
+        munmap(over, mapping - over);
+    if (mapping + size < over + size + RM_HUGEPAGE_SIZE)
+        munmap(mapping + size, over + size + RM_HUGEPAGE_SIZE - (mapping + size));
+
+#ifdef MADV_HUGEPAGE
+    madvise(mapping, size, MADV_HUGEPAGE);
+#endif
+
+    return mapping;
+}
+
+
+bool rm_init_hugepage(uint32_t size) {
+    if (size == 0 || size > UINT32_MAX - RM_HUGEPAGE_SIZE)
+        return false;
+    size = HUGEPAGE_ROUND_UP(size);
+
+    void *mapping = hugepage_map(size);
+    if (mapping == NULL)
+        return false;
+
+    if (g_state == NULL)
+        g_heap_state = calloc(1, sizeof(rmalloc_meta_t));
+
+    // already zero-filled, and touching it would fault in every page
+    heap_init(mapping, size);
+    g_state->mapping = mapping;
+    g_state->mapping_size = size;
+    g_state->hugepage = true;
+
+    return true;
+}
+
+
+/* give the whole regions between memory_top and the header table back to
+ * the system. they're zero-filled when touched again.
+ */
+static void hugepage_trim(void) {
+    uintptr_t start = HUGEPAGE_ROUND_UP(g_state->memory_top);
+    uintptr_t end = HUGEPAGE_ROUND_DOWN(g_state->header_bottom);
+
+    if (start < end)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+
+/* move every block that reaches into the topmost region to free blocks
+ * below it, or none of them. called by rm_compact() before sorting the
+ * headers, so the list may be in any order.
+ */
+static void hugepage_evacuate(void) {
+    if ((uintptr_t)g_state->memory_top <= (uintptr_t)g_state->memory_bottom)
+        return;
+
+    uintptr_t cut = HUGEPAGE_ROUND_DOWN((uintptr_t)g_state->memory_top - 1);
+    if (cut <= (uintptr_t)g_state->memory_bottom)
+        return;
+
+    uint32_t block_count = 0, free_count = 0;
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        if (rm_header_is_unused(h))
+            continue;
+
+        if (h->type == BLOCK_TYPE_FREE) {
+            if ((uintptr_t)h->memory + h->size <= cut)
+                free_count++;
+        } else if ((uintptr_t)h->memory + h->size > cut) {
+            if (h->type != BLOCK_TYPE_UNLOCKED)
+                return;
+            block_count++;
+        }
+    }
+
+    if (block_count == 0 || free_count == 0)
+        return;
+
+    rm_header_t **blocks = (rm_header_t **)malloc(sizeof(rm_header_t *) * block_count);
+    rm_header_t **frees = (rm_header_t **)malloc(sizeof(rm_header_t *) * free_count);
+    uintptr_t *dest = (uintptr_t *)malloc(sizeof(uintptr_t) * block_count);
+    uintptr_t *free_memory = (uintptr_t *)malloc(sizeof(uintptr_t) * free_count);
+    uint32_t *free_size = (uint32_t *)malloc(sizeof(uint32_t) * free_count);
+    if (blocks == NULL || frees == NULL || dest == NULL || free_memory == NULL || free_size == NULL)
+        goto finish;
+
+    block_count = free_count = 0;
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        if (rm_header_is_unused(h))
+            continue;
+
+        if (h->type == BLOCK_TYPE_FREE) {
+            if ((uintptr_t)h->memory + h->size <= cut) {
+                free_memory[free_count] = (uintptr_t)h->memory;
+                free_size[free_count] = h->size;
+                frees[free_count++] = h;
+            }
+        } else if ((uintptr_t)h->memory + h->size > cut) {
+            blocks[block_count++] = h;
+        }
+    }
+
+    // plan first fit, all or nothing. a free block is either used up or
+    // keeps room for its free_memory_block_t.
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint32_t size = blocks[i]->size;
+        uint32_t j = 0;
+        for (; j < free_count; j++) {
+            if (free_size[j] == size || free_size[j] >= size + sizeof(free_memory_block_t))
+                break;
+        }
+        if (j == free_count)
+            goto finish;
+
+        dest[i] = free_memory[j];
+        free_memory[j] += size;
+        free_size[j] -= size;
+    }
+
+    if (heap_concurrent()) {
+        uint32_t claimed = 0;
+        for (; claimed < block_count; claimed++) {
+            uint16_t unlocked = 0;
+            if (!__atomic_compare_exchange_n(&blocks[claimed]->lock_count, &unlocked, RM_LOCK_MOVING, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                blocks[claimed]->type = BLOCK_TYPE_LOCKED;
+                break;
+            }
+        }
+
+        if (claimed < block_count || pins_check_moving()) {
+            for (uint32_t i = 0; i < claimed; i++)
+                __atomic_store_n(&blocks[i]->lock_count, 0, __ATOMIC_RELEASE);
+            goto finish;
+        }
+    }
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        rm_header_t *h = blocks[i];
+        TRACE(RM_TRACE_MOVE, h, h->memory, (void *)dest[i], h->size);
+        void *old_memory = h->memory;
+        memcpy((void *)dest[i], old_memory, h->size);
+        h->memory = (void *)dest[i];
+        block_moved(h, old_memory);
+        STATS_COMPACT_MOVED(h->size);
+
+        if (heap_concurrent())
+            __atomic_store_n(&h->lock_count, 0, __ATOMIC_RELEASE);
+    }
+
+    // shrink the free blocks from below. the old places of the moved blocks
+    // are above every used block now, and are pruned at the end of
+    // rm_compact(), which also rebuilds the free lists.
+    for (uint32_t j = 0; j < free_count; j++) {
+        frees[j]->memory = (void *)free_memory[j];
+        frees[j]->size = free_size[j];
+    }
+
+    rm_header_t *prev = NULL;
+    rm_header_t *h = g_state->header_root;
+    while (h != NULL) {
+        rm_header_t *next = h->next;
+        if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_FREE && h->size == 0) {
+            if (prev == NULL)
+                g_state->header_root = next;
+            else
+                prev->next = next;
+            header_set_unused(h);
+        } else {
+            prev = h;
+        }
+        h = next;
+    }
+
+finish:
+    free(blocks);
+    free(frees);
+    free(dest);
+    free(free_memory);
+    free(free_size);
+}
+
+
+static void hugepage_destroy(void) {
+    munmap(g_state->mapping, g_state->mapping_size);
+    g_state->mapping = NULL;
+    g_state->mapping_size = 0;
+    g_state->hugepage = false;
+}
+
+#else
+
+bool rm_init_hugepage(uint32_t size) {
+    (void)size;
+    return false;
+}
+
+
+static void hugepage_trim(void) {
+}
+
+
+static void hugepage_evacuate(void) {
+}
+
+
+static void hugepage_destroy(void) {
+}
+
+#endif // __BILLY__
@@ -5,6 +5,10 @@
 
 #include "compact.h"
 
+#ifndef __BILLY__
+#include <pthread.h>
+#endif
+
 /* header, see compact.h
  */
 
@@ -18,26 +22,74 @@ extern "C" {
 #endif
 
 
+/* optional features, all on unless built for __BILLY__ or with
+ * RMALLOC_FEATURES=0 (make minimal), and each can be set on its own. one
+ * that's off leaves stubs that fail or do nothing, and its checks in
+ * rm_malloc(), rm_free(), rm_lock() and rm_unlock() compile away.
+ */
+#ifndef RMALLOC_FEATURES
+#ifdef __BILLY__
+#define RMALLOC_FEATURES 0
+#else
+#define RMALLOC_FEATURES 1
+#endif
+#endif
+
+#ifndef RMALLOC_CONCURRENT // compact_concurrent.c, and shared heaps
+#define RMALLOC_CONCURRENT RMALLOC_FEATURES
+#endif
+#ifndef RMALLOC_SAMPLING // pinned zone, rm_set_sampling()
+#define RMALLOC_SAMPLING RMALLOC_FEATURES
+#endif
+#ifndef RMALLOC_GROUPS // compact_group.c
+#define RMALLOC_GROUPS RMALLOC_FEATURES
+#endif
+#ifndef RMALLOC_COMPRESS // compact_compress.c and compact_spill.c
+#define RMALLOC_COMPRESS RMALLOC_FEATURES
+#endif
+#ifndef RMALLOC_DEDUP // compact_dedup.c, needs next_unused
+#define RMALLOC_DEDUP (RMALLOC_FEATURES && JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0)
+#endif
+#ifndef RMALLOC_GENERATIONS // of rm_index() handles
+#define RMALLOC_GENERATIONS RMALLOC_FEATURES
+#endif
+#ifndef RMALLOC_TAGS // compact_tag.c
+#define RMALLOC_TAGS RMALLOC_FEATURES
+#endif
+
+#if RMALLOC_DEDUP && JEFF_MAX_RAM_VS_SLOWER_MALLOC
+#error "RMALLOC_DEDUP needs JEFF_MAX_RAM_VS_SLOWER_MALLOC=0"
+#endif
+
+#define heap_concurrent() (RMALLOC_CONCURRENT && g_state->concurrent)
+
+
 typedef enum {
     BLOCK_TYPE_FREE         = 0,
     BLOCK_TYPE_UNLOCKED     = 1,
     BLOCK_TYPE_LOCKED       = 2,
     BLOCK_TYPE_WEAK_LOCKED  = 3,
+    BLOCK_TYPE_ALIAS        = 4, // shares another header's block, see compact_dedup.c
 } rm_block_type_t;
 
 
-#pragma pack(1)
+/* not packed: lock_count is updated with atomic operations in concurrent
+ * heaps, and must be naturally aligned. ordered so that there is no padding
+ * except at the end.
+ */
 struct rm_header_t {
     void *memory;
-    uint32_t size;
-    uint8_t type;
 
     struct rm_header_t *next;
 #if JEFF_MAX_RAM_VS_SLOWER_MALLOC == 0
     struct rm_header_t *next_unused;
 #endif
+
+    uint32_t size;
+    uint16_t lock_count; // nested rm_lock() calls, see compact_concurrent.c
+    uint8_t type;
+    uint8_t move_cb; // 1 + index in rmalloc_meta_t::move_cbs, 0 if none
 };
-#pragma pack()
 
 /* free memory block, see compact.h
  */
@@ -46,6 +98,24 @@ typedef struct free_memory_block_t {
     struct free_memory_block_t *next; // null if no next block.
 } free_memory_block_t;
 
+/* handle group, see compact_group.c
+ */
+typedef struct rm_group_slot_t {
+    rm_header_t *chunk; // members are carved off its bottom, NULL = none
+    uint32_t chunk_size; // 0 = slot not in use
+    uint32_t live; // members not freed on their own
+    uint32_t *members; // handle indices
+    uint32_t count;
+    uint32_t capacity;
+} rm_group_slot_t;
+
+/* free space in the spill file, see compact_spill.c
+ */
+typedef struct rm_spill_hole_t {
+    uint64_t offset;
+    uint64_t size;
+} rm_spill_hole_t;
+
 struct rmalloc_meta_t {
     /* memory layout
      */
@@ -60,6 +130,72 @@ struct rmalloc_meta_t {
     short free_block_slot_count; // log2(heap_size)
     int free_block_hits;
     uint32_t free_block_alloc;
+    uint8_t placement; // rm_placement_t
+
+    /* callbacks given to rm_malloc_movable_cb() */
+    rm_move_cb move_cbs[RM_MOVE_CB_COUNT];
+
+    /* called by rm_malloc() when out of memory, see rm_set_oom_handler() */
+    rm_oom_handler oom_handler;
+    void *oom_arg;
+
+    /* access samples for rm_compact_locality(), handle indices in a ring.
+     * not in shared heaps. */
+    uint32_t sample_every; // 0 = off
+    uint32_t sample_counter;
+    uint32_t sample_next;
+    uint32_t *samples; // RM_SAMPLE_COUNT, NULL until rm_set_sampling()
+
+    /* lock scores by handle index, for rm_set_pinned_zone(). not in shared
+     * heaps. */
+    uint8_t *lock_scores; // NULL = off
+    uint32_t lock_scores_count;
+    void *zone_top; // end of the pinned zone
+
+    /* handle groups and group ids by handle index, see rm_group_create().
+     * not in shared heaps. */
+    rm_group_slot_t *groups; // RM_GROUP_COUNT, NULL until the first group
+    uint8_t *group_ids;
+    uint32_t group_ids_count;
+
+    /* ages and compressed flags by handle index, for rm_set_compression().
+     * not in shared or file heaps. */
+    uint8_t *compress_ages; // NULL = off
+    uint32_t compress_ages_count;
+    uint8_t compress_cold_after;
+
+    /* spill file for rm_set_spill(), uses the ages above */
+    int spill_fd; // -1 = off
+    uint8_t spill_cold_after;
+    uint64_t spill_end;
+    rm_spill_hole_t *spill_holes;
+    uint32_t spill_hole_count;
+    uint32_t spill_hole_capacity;
+
+    /* immutable and owner marks by handle index, for rm_mark_immutable().
+     * not in shared heaps. */
+    uint8_t *dedup_flags; // NULL until the first mark
+    uint32_t dedup_flags_count;
+    uint32_t dedup_pending; // marked since the last rm_compact()
+
+    /* generations by handle index, for rm_index(). not in shared or file
+     * heaps. */
+    uint8_t *generations; // NULL until the first rm_index()
+    uint32_t generations_count;
+
+    /* tags by handle index, and usage and soft limits by tag, see
+     * rm_malloc_tagged(). the tags are not in shared heaps. */
+    uint8_t *tags; // NULL until the first tagged block
+    uint32_t tags_count;
+    uint64_t tag_bytes[RM_TAG_COUNT];
+    uint32_t tag_handles[RM_TAG_COUNT];
+    uint64_t tag_limits[RM_TAG_COUNT]; // 0 = none
+    rm_tag_limit_cb tag_limit_cbs[RM_TAG_COUNT];
+    void *tag_limit_args[RM_TAG_COUNT];
+
+    /* kept between rm_compact_copying() calls, not in shared heaps */
+    void *to_space;
+    size_t to_space_size;
 
     /* header */
     // headers grow down in memory
@@ -73,12 +209,44 @@ struct rmalloc_meta_t {
 
     rm_header_t *highest_address_header;
 
+    /* file or anonymous mapping, if initialized with rm_init_file(),
+     * rm_init_shared() or rm_init_hugepage() */
+    void *mapping;
+    size_t mapping_size;
+
+    /* shared between processes, see rm_init_shared() */
+    bool shared;
+
+    /* backed by huge pages, see compact_hugepage.c */
+    bool hugepage;
+
+    /* used from several threads or processes, see compact_concurrent.c */
+    bool concurrent;
+#ifndef __BILLY__
+    pthread_mutex_t mutex; // serializes malloc, free and compact
+#endif
+
     #ifdef RMALLOC_DEBUG
     uint32_t g_memlayout_sequence = 0;
     static bool g_debugging = false;
     #endif
 };
 
+/* arena, placed at the start of the region given to rm_arena_create(), and
+ * followed by the arena's heap.
+ */
+struct rm_arena_t {
+    rmalloc_meta_t state;
+    void *heap;
+    uint32_t size;
+};
+
+// lock_count of a block that rm_compact() is moving
+#define RM_LOCK_MOVING UINT16_MAX
+
+// smallest heap that fits the free slots and a few headers
+#define RM_ARENA_MIN_HEAP_SIZE 1024
+
 typedef uintptr_t (*rm_compare_cb)(void *a, void *b);
 
 // TODO these should be static, except the tests want them
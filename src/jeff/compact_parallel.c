@@ -0,0 +1,270 @@
+/* compact_parallel.c
+ *
+ * full compaction on several threads, see rm_compact_parallel().
+ *
+ * included from compact.c.
+ *
+ * unlike rm_compact(), blocks never pass a locked block: the heap is divided
+ * at locked blocks into segments, and the unlocked blocks of each segment
+ * slide down to its start. all destinations are computed up front, in one
+ * pass over the sorted header list, so the destination ranges of different
+ * blocks never overlap.
+ *
+ * the moves are then split into chunks of about the same number of bytes,
+ * one per thread. a block's destination may still hold sources of a lower
+ * chunk that haven't been moved yet, so each chunk publishes how far it has
+ * read, and a chunk only writes below what the lower chunks have read. with
+ * the heap half full, chunk n trails chunk n/2, and all of them run at once.
+ *
+ * the move callbacks (see rm_malloc_movable_cb()) are run after the join,
+ * on the calling thread, so they needn't be thread-safe. the blocks are all
+ * in place by then.
+ *
+ * finally the free headers are rebuilt from the gaps between used blocks,
+ * followed by rebuild_free_block_slots().
+ */
+
+#ifndef __BILLY__
+
+typedef struct parallel_move_t {
+    rm_header_t *h; // ->memory is the destination
+    uintptr_t source;
+} parallel_move_t;
+
+typedef struct parallel_chunk_t {
+    parallel_move_t *moves;
+    uint32_t first, last; // moves[first..last-1]
+    uintptr_t source_end;
+    uintptr_t frontier; // everything below has been read, written atomically
+    struct parallel_chunk_t *chunks;
+    int index;
+    uint64_t bytes_moved;
+} parallel_chunk_t;
+
+
+static void *parallel_chunk_move(void *arg) {
+    parallel_chunk_t *chunk = (parallel_chunk_t *)arg;
+    parallel_chunk_t *chunks = chunk->chunks;
+
+    for (uint32_t i = chunk->first; i < chunk->last; i++) {
+        rm_header_t *h = chunk->moves[i].h;
+        uintptr_t source = chunk->moves[i].source;
+        uintptr_t dest = (uintptr_t)h->memory;
+
+        if (dest != source) {
+            // wait for lower chunks whose sources are in the way
+            for (int j = chunk->index - 1; j >= 0 && chunks[j].source_end > dest; j--) {
+                uintptr_t needed = dest + h->size;
+                if (needed > chunks[j].source_end)
+                    needed = chunks[j].source_end;
+                while (__atomic_load_n(&chunks[j].frontier, __ATOMIC_ACQUIRE) < needed)
+                    sched_yield();
+            }
+
+            TRACE(RM_TRACE_MOVE, h, (void *)source, (void *)dest, h->size);
+            memmove((void *)dest, (void *)source, h->size);
+            chunk->bytes_moved += h->size;
+        }
+
+        uintptr_t read = i + 1 < chunk->last ? chunk->moves[i + 1].source : chunk->source_end;
+        __atomic_store_n(&chunk->frontier, read, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+/* relink the used headers (in address order) with new free headers for the
+ * gaps between them.
+ */
+static void stitch_used_headers(rm_header_t **used, uint32_t used_count) {
+    uintptr_t end = (uintptr_t)g_state->memory_bottom;
+    rm_header_t *prev = NULL;
+    g_state->header_root = NULL;
+
+    for (uint32_t i = 0; i < used_count; i++) {
+        rm_header_t *h = used[i];
+        uint32_t gap = (uintptr_t)h->memory - end;
+
+        if (gap > 0) {
+            rm_header_t *free_header = header_new(/*insert_in_list*/false);
+            if (free_header != NULL) {
+                free_header->type = BLOCK_TYPE_FREE;
+                free_header->memory = (void *)end;
+                free_header->size = gap;
+
+                if (prev == NULL)
+                    g_state->header_root = free_header;
+                else
+                    prev->next = free_header;
+                prev = free_header;
+            }
+        }
+
+        if (prev == NULL)
+            g_state->header_root = h;
+        else
+            prev->next = h;
+        prev = h;
+        end = (uintptr_t)h->memory + h->size;
+    }
+
+    if (prev != NULL)
+        prev->next = NULL;
+
+    if (used_count > 0)
+        update_highest_address_if_needed(used[used_count - 1]);
+
+    g_state->memory_top = (void *)end;
+}
+
+
+void rm_compact_parallel(uint32_t threads) {
+    if (threads < 1)
+        threads = 1;
+    if (threads > RM_COMPACT_MAX_THREADS)
+        threads = RM_COMPACT_MAX_THREADS;
+
+    STATS_DECL;
+    STATS_START;
+    STATS_COMPACT_START;
+
+    if (heap_concurrent())
+        concurrent_compact_begin();
+    pins_compact_begin();
+
+    rm_header_sort_all();
+
+    uint32_t header_count = 0;
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next)
+        header_count++;
+
+    rm_header_t **used = (rm_header_t **)malloc(sizeof(rm_header_t *) * (header_count + 1));
+    parallel_move_t *moves = (parallel_move_t *)malloc(sizeof(parallel_move_t) * (header_count + 1));
+    if (used == NULL || moves == NULL) {
+        free(used);
+        free(moves);
+        pins_compact_end();
+        if (heap_concurrent())
+            concurrent_compact_end();
+        rm_compact(0);
+        return;
+    }
+
+    if (heap_concurrent())
+        concurrent_claim_all();
+
+    // plan: slide unlocked blocks down to the end of the previous locked block
+    uint32_t used_count = 0, move_count = 0;
+    uint64_t move_bytes = 0;
+    uintptr_t dest = (uintptr_t)g_state->memory_bottom;
+
+    rm_header_t *h = g_state->header_root;
+    while (h != NULL) {
+        rm_header_t *next = h->next;
+        STATS_COMPACT_VISITED;
+
+        if (rm_header_is_unused(h)) {
+            // nothing
+        } else if (h->type == BLOCK_TYPE_FREE) {
+            header_set_unused(h);
+        } else {
+            if (h->type == BLOCK_TYPE_UNLOCKED) {
+                moves[move_count].h = h;
+                moves[move_count].source = (uintptr_t)h->memory;
+                move_count++;
+                if ((uintptr_t)h->memory != dest)
+                    move_bytes += h->size;
+
+                h->memory = (void *)dest;
+            }
+
+            used[used_count++] = h;
+            dest = (uintptr_t)h->memory + h->size;
+        }
+
+        h = next;
+    }
+
+    // split into chunks of about the same number of bytes to move
+    parallel_chunk_t chunks[RM_COMPACT_MAX_THREADS];
+    uint32_t chunk_count = 0;
+    uint32_t first = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < move_count; i++) {
+        if ((uintptr_t)moves[i].h->memory != moves[i].source)
+            bytes += moves[i].h->size;
+
+        bool last = i + 1 == move_count;
+        if (last || (chunk_count + 1 < threads && move_bytes > 0 && bytes >= move_bytes * (chunk_count + 1) / threads)) {
+            parallel_chunk_t *chunk = &chunks[chunk_count];
+            chunk->moves = moves;
+            chunk->first = first;
+            chunk->last = i + 1;
+            chunk->source_end = last ? UINTPTR_MAX : moves[i + 1].source;
+            chunk->frontier = moves[first].source;
+            chunk->chunks = chunks;
+            chunk->index = chunk_count;
+            chunk->bytes_moved = 0;
+
+            chunk_count++;
+            first = i + 1;
+        }
+    }
+
+    pthread_t workers[RM_COMPACT_MAX_THREADS];
+    uint32_t started = 1;
+    for (; started < chunk_count; started++) {
+        if (pthread_create(&workers[started], NULL, parallel_chunk_move, &chunks[started]) != 0)
+            break;
+    }
+
+    // this thread takes the first chunk, and any that couldn't be started.
+    // those only wait for lower chunks, so running them in order is fine.
+    if (chunk_count > 0)
+        parallel_chunk_move(&chunks[0]);
+    for (uint32_t i = started; i < chunk_count; i++)
+        parallel_chunk_move(&chunks[i]);
+    for (uint32_t i = 1; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    for (uint32_t i = 0; i < move_count; i++) {
+        if ((uintptr_t)moves[i].h->memory != moves[i].source)
+            block_moved(moves[i].h, (void *)moves[i].source);
+    }
+    for (uint32_t i = 0; i < chunk_count; i++)
+        STATS_COMPACT_MOVED(chunks[i].bytes_moved);
+
+    stitch_used_headers(used, used_count);
+
+    header_trim();
+
+    rebuild_free_block_slots();
+
+    if (g_state->hugepage)
+        hugepage_trim();
+
+    if (heap_concurrent()) {
+        for (uint32_t i = 0; i < move_count; i++)
+            __atomic_store_n(&moves[i].h->lock_count, 0, __ATOMIC_RELEASE);
+    }
+
+    free(used);
+    free(moves);
+
+    pins_compact_end();
+    if (heap_concurrent())
+        concurrent_compact_end();
+
+    STATS_END(RM_STATS_COMPACT);
+    STATS_COMPACT_END_NO_BUDGET;
+}
+
+#else
+
+void rm_compact_parallel(uint32_t threads) {
+    (void)threads;
+    rm_compact(0);
+}
+
+#endif // __BILLY__
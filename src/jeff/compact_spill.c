@@ -0,0 +1,244 @@
+/* compact_spill.c
+ *
+ * spilling cold blocks to a file, see rm_set_spill().
+ *
+ * included from compact.c.
+ *
+ * rm_compact() ages the blocks like for compression (see compact_compress.c),
+ * and writes the cold ones to the spill file. the block is shrunk to a stub
+ * with the file offset and size, and the rest freed, for rm_compact() to
+ * reclaim. compressed blocks are spilled compressed. locking a spilled block
+ * reads it back into a new block, which the handle takes over.
+ *
+ * the file is unlinked right after it's opened, so it goes away with the
+ * process. the space of blocks that are read back or freed is kept in a list
+ * of holes, merged with their neighbours, and used first fit. the file
+ * shrinks when its last block is gone.
+ *
+ * nothing is read ahead, rm_prefetch() tells the kernel to. the stubs are
+ * plain blocks, so a spilled block is as cheap to move as a small one.
+ */
+
+#if RMALLOC_COMPRESS
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct spill_stub_t {
+    uint64_t offset;
+    uint32_t size;
+} spill_stub_t;
+
+
+static void spill_stub(rm_header_t *h, spill_stub_t *stub) {
+    memcpy(stub, h->memory, sizeof(spill_stub_t));
+}
+
+
+static uint64_t spill_alloc(uint32_t size) {
+    for (uint32_t i = 0; i < g_state->spill_hole_count; i++) {
+        rm_spill_hole_t *hole = &g_state->spill_holes[i];
+        if (hole->size >= size) {
+            uint64_t offset = hole->offset;
+            hole->offset += size;
+            hole->size -= size;
+            if (hole->size == 0)
+                *hole = g_state->spill_holes[--g_state->spill_hole_count];
+            return offset;
+        }
+    }
+
+    uint64_t offset = g_state->spill_end;
+    g_state->spill_end += size;
+    return offset;
+}
+
+
+static void spill_free(uint64_t offset, uint64_t size) {
+    // merge with the holes on either side
+    for (uint32_t i = 0; i < g_state->spill_hole_count; ) {
+        rm_spill_hole_t *hole = &g_state->spill_holes[i];
+        if (hole->offset + hole->size == offset || offset + size == hole->offset) {
+            if (hole->offset < offset)
+                offset = hole->offset;
+            size += hole->size;
+            *hole = g_state->spill_holes[--g_state->spill_hole_count];
+            continue;
+        }
+        i++;
+    }
+
+    if (offset + size == g_state->spill_end) {
+        g_state->spill_end = offset;
+        if (offset > 0)
+            return;
+
+        // the file is empty. if it can't be truncated, the disk space is
+        // kept and written over by the next blocks spilled.
+        int result = ftruncate(g_state->spill_fd, 0);
+        (void)result;
+        return;
+    }
+
+    if (g_state->spill_hole_count == g_state->spill_hole_capacity) {
+        uint32_t capacity = g_state->spill_hole_capacity > 0 ? g_state->spill_hole_capacity * 2 : 64;
+        rm_spill_hole_t *holes = (rm_spill_hole_t *)realloc(g_state->spill_holes, sizeof(rm_spill_hole_t) * capacity);
+        if (holes == NULL)
+            return; // lost until the file is empty
+        g_state->spill_holes = holes;
+        g_state->spill_hole_capacity = capacity;
+    }
+    g_state->spill_holes[g_state->spill_hole_count].offset = offset;
+    g_state->spill_holes[g_state->spill_hole_count].size = size;
+    g_state->spill_hole_count++;
+}
+
+
+static bool spill_out(rm_header_t *h) {
+    uint32_t size = h->size;
+    if (size < 2 * sizeof(spill_stub_t) + sizeof(free_memory_block_t))
+        return false;
+
+    spill_stub_t stub;
+    stub.size = size;
+    stub.offset = spill_alloc(size);
+
+    const uint8_t *p = (const uint8_t *)h->memory;
+    for (uint32_t done = 0; done < size; ) {
+        ssize_t n = pwrite(g_state->spill_fd, p + done, size - done, stub.offset + done);
+        if (n <= 0) {
+            spill_free(stub.offset, size);
+            return false;
+        }
+        done += n;
+    }
+
+    if (!block_shrink(h, sizeof(spill_stub_t))) {
+        spill_free(stub.offset, size);
+        return false;
+    }
+    memcpy(h->memory, &stub, sizeof(spill_stub_t));
+    return true;
+}
+
+
+static bool spill_in(rm_header_t *h) {
+    spill_stub_t stub;
+    spill_stub(h, &stub);
+
+    rm_header_t *n = block_new(stub.size);
+    if (n == NULL)
+        return false;
+
+    uint8_t *p = (uint8_t *)n->memory;
+    for (uint32_t done = 0; done < stub.size; ) {
+        ssize_t r = pread(g_state->spill_fd, p + done, stub.size - done, stub.offset + done);
+        if (r <= 0) {
+            block_free(n);
+            return false;
+        }
+        done += r;
+    }
+
+    block_replace(h, n);
+    spill_free(stub.offset, stub.size);
+    return true;
+}
+
+
+/* a spilled block is freed */
+static void spill_release(rm_header_t *h) {
+    spill_stub_t stub;
+    spill_stub(h, &stub);
+    spill_free(stub.offset, stub.size);
+}
+
+
+static void spill_close(void) {
+    close(g_state->spill_fd);
+    g_state->spill_fd = -1;
+    g_state->spill_end = 0;
+    free(g_state->spill_holes);
+    g_state->spill_holes = NULL;
+    g_state->spill_hole_count = 0;
+    g_state->spill_hole_capacity = 0;
+}
+
+
+bool rm_set_spill(const char *path, uint32_t cold_after) {
+    if (path == NULL) {
+        if (g_state->spill_fd < 0)
+            return true;
+
+        for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+            uint8_t *age = compress_age(h);
+            if (age == NULL || !(*age & SPILLED))
+                continue;
+            if (!spill_in(h))
+                return false;
+            *age &= ~SPILLED;
+        }
+        spill_close();
+        if (g_state->compress_cold_after == 0) {
+            free(g_state->compress_ages);
+            g_state->compress_ages = NULL;
+            g_state->compress_ages_count = 0;
+        }
+        return true;
+    }
+
+    if (g_state->spill_fd >= 0 || heap_concurrent() || g_state->mapping != NULL || !compress_ages_alloc())
+        return false;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    unlink(path);
+
+    g_state->spill_fd = fd;
+    g_state->spill_end = 0;
+    if (cold_after == 0)
+        cold_after = 1;
+    g_state->spill_cold_after = cold_after < COMPRESS_AGE_MASK ? cold_after : COMPRESS_AGE_MASK;
+    return true;
+}
+
+
+void rm_prefetch(rm_handle_t h) {
+    rm_header_t *f = header_owner((rm_header_t *)h);
+    uint8_t *age = compress_age(f);
+    if (age == NULL || !(*age & SPILLED))
+        return;
+
+    spill_stub_t stub;
+    spill_stub(f, &stub);
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(g_state->spill_fd, stub.offset, stub.size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+static void spill_destroy(void) {
+    if (g_state == NULL || g_state->spill_fd < 0)
+        return;
+
+    spill_close();
+}
+
+#else
+
+bool rm_set_spill(const char *path, uint32_t cold_after) {
+    (void)cold_after;
+    return path == NULL;
+}
+
+
+void rm_prefetch(rm_handle_t h) {
+    (void)h;
+}
+
+
+static void spill_destroy(void) {
+}
+
+#endif // RMALLOC_COMPRESS
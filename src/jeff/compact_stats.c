@@ -0,0 +1,148 @@
+/* compact_stats.c
+ *
+ * latency histograms for rm_malloc, rm_free, rm_lock and rm_compact.
+ *
+ * included from compact.c. only collected when built with RMALLOC_STATS=1,
+ * otherwise the STATS_* macros expand to nothing and rm_stats_histogram()
+ * always returns false.
+ *
+ * histograms are log-linear: each power of two is split into
+ * RM_HISTOGRAM_SUB_BUCKETS linear steps, i.e. values 0..3 get a bucket each,
+ * 4, 5, 6, 7 get a bucket each, 8-9, 10-11, ... and so on.
+ *
+ * rm_lock() is recorded from any thread, and rm_compact() from the
+ * background compactor, so the histograms are updated with relaxed atomics.
+ * a compaction runs on one thread from start to end, its counters are
+ * per thread.
+ */
+
+uint64_t rm_stats_bucket_value(int bucket) {
+    if (bucket < RM_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    int e = bucket / RM_HISTOGRAM_SUB_BUCKETS + 1;
+    uint64_t sub = bucket % RM_HISTOGRAM_SUB_BUCKETS;
+
+    return (1ULL << e) + (sub << (e - 2));
+}
+
+
+#if RMALLOC_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline uint64_t stats_cycles(void) {
+    return __rdtsc();
+}
+#else
+static inline uint64_t stats_cycles(void) {
+    return uptime_nanoseconds();
+}
+#endif
+
+
+static rm_histogram_t g_stats_histograms[RM_STATS_COUNT];
+
+// compaction counters, reset at each rm_compact() call
+static __thread uint64_t t_stats_bytes_moved = 0;
+static __thread uint64_t t_stats_headers_visited = 0;
+
+
+static int stats_bucket(uint64_t value) {
+    if (value < RM_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    int e = sizeof(value)*8 - 1 - __builtin_clzll(value);
+    int sub = (value >> (e - 2)) & (RM_HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (e - 1) * RM_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+
+static void stats_record(rm_stats_kind_t kind, uint64_t value) {
+    rm_histogram_t *hist = &g_stats_histograms[kind];
+
+    // min is kept + 1, so that 0 is none yet, as after rm_stats_reset()
+    uint64_t min = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while ((min == 0 || value + 1 < min)
+           && !__atomic_compare_exchange_n(&hist->min, &min, value + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > max
+           && !__atomic_compare_exchange_n(&hist->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[stats_bucket(value)], 1, __ATOMIC_RELAXED);
+}
+
+
+/* a snapshot, the fields are read one by one while other threads may be
+ * recording */
+bool rm_stats_histogram(rm_stats_kind_t kind, rm_histogram_t *hist) {
+    if (kind >= RM_STATS_COUNT || hist == NULL)
+        return false;
+
+    rm_histogram_t *from = &g_stats_histograms[kind];
+    hist->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    hist->sum = __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    hist->min = min > 0 ? min - 1 : 0;
+    hist->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    for (int i=0; i<RM_HISTOGRAM_BUCKETS; i++)
+        hist->buckets[i] = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    return true;
+}
+
+
+void rm_stats_reset(void) {
+    uint64_t *counts = (uint64_t *)g_stats_histograms;
+    const size_t count = RM_STATS_COUNT * sizeof(rm_histogram_t) / sizeof(uint64_t);
+    for (size_t i=0; i<count; i++)
+        __atomic_store_n(&counts[i], 0, __ATOMIC_RELAXED);
+}
+
+
+#define STATS_DECL uint64_t stats_start_cycles
+#define STATS_START stats_start_cycles = stats_cycles()
+#define STATS_END(kind) stats_record(kind, stats_cycles() - stats_start_cycles)
+
+#define STATS_COMPACT_START t_stats_bytes_moved = 0; t_stats_headers_visited = 0
+#define STATS_COMPACT_MOVED(bytes) t_stats_bytes_moved += (bytes)
+#define STATS_COMPACT_VISITED t_stats_headers_visited++
+#define STATS_COMPACT_END_NO_BUDGET { \
+    stats_record(RM_STATS_COMPACT_BYTES_MOVED, t_stats_bytes_moved); \
+    stats_record(RM_STATS_COMPACT_HEADERS_VISITED, t_stats_headers_visited); \
+    }
+#define STATS_COMPACT_END(time_used, maxtime) { \
+    STATS_COMPACT_END_NO_BUDGET; \
+    if ((maxtime) > 0) \
+        stats_record(RM_STATS_COMPACT_BUDGET_USED, (uint64_t)(time_used)*100/(maxtime)); \
+    }
+
+#else
+
+bool rm_stats_histogram(rm_stats_kind_t kind, rm_histogram_t *hist) {
+    (void)kind;
+    (void)hist;
+    return false;
+}
+
+
+void rm_stats_reset(void) {
+}
+
+
+#define STATS_DECL
+#define STATS_START
+#define STATS_END(kind)
+
+#define STATS_COMPACT_START
+#define STATS_COMPACT_MOVED(bytes)
+#define STATS_COMPACT_VISITED
+#define STATS_COMPACT_END_NO_BUDGET
+#define STATS_COMPACT_END(time_used, maxtime)
+
+#endif // RMALLOC_STATS
@@ -0,0 +1,174 @@
+/* compact_tag.c
+ *
+ * per-tag accounting and soft limits, see rm_malloc_tagged().
+ *
+ * included from compact.c.
+ *
+ * the header has no bits to spare, so a handle's tag is a byte in a table by
+ * handle index, like the group ids. the bytes and handles of each tag are
+ * counted in the state, and changed wherever a tagged block changes size:
+ * rm_malloc_tagged() and rm_free(), rm_compact() extending the last block it
+ * slid into a hole too small for a free block, compression and spilling
+ * shrinking it and rm_lock() bringing it back (see block_shrink() and
+ * block_replace()), and dedup_collapse() making it an alias, which has no
+ * block of its own.
+ *
+ * the table is malloc()'ed, so not in shared heaps, and a reopened file heap
+ * forgets the tags and starts counting from 0. the counts are changed with
+ * the heap mutex held in concurrent heaps, which is the case for all of the
+ * above.
+ */
+
+#if RMALLOC_TAGS
+
+static uint8_t *tag_of(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    return index < g_state->tags_count ? &g_state->tags[index] : NULL;
+}
+
+
+/* called by malloc_with_cb() with the new block, under the heap mutex */
+static void tag_set(rm_header_t *h, uint8_t tag) {
+    uint8_t *t;
+    if (tag == 0 || (t = tag_of(h)) == NULL)
+        return;
+
+    *t = tag;
+    g_state->tag_bytes[tag] += h->size;
+    g_state->tag_handles[tag]++;
+}
+
+
+/* h's block has grown (or shrunk) by delta bytes */
+static void tag_charge(rm_header_t *h, int64_t delta) {
+    uint8_t *t = tag_of(h);
+    if (t != NULL && *t != 0)
+        g_state->tag_bytes[*t] += delta;
+}
+
+
+/* called by rm_free() */
+static void tag_forget(rm_header_t *h) {
+    uint8_t *t = tag_of(h);
+    if (t == NULL || *t == 0)
+        return;
+
+    if (h->type != BLOCK_TYPE_ALIAS)
+        g_state->tag_bytes[*t] -= h->size;
+    g_state->tag_handles[*t]--;
+    *t = 0;
+}
+
+
+rm_handle_t rm_malloc_tagged(int size, uint8_t tag) {
+    if (tag == 0 || tag >= RM_TAG_COUNT || g_state->shared)
+        return NULL;
+
+    if (g_state->tags == NULL) {
+        if (heap_concurrent())
+            heap_mutex_lock();
+        if (g_state->tags == NULL) {
+            uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+            g_state->tags = (uint8_t *)calloc(count, 1);
+            if (g_state->tags != NULL)
+                g_state->tags_count = count;
+        }
+        if (heap_concurrent())
+            heap_mutex_unlock();
+        if (g_state->tags == NULL)
+            return NULL;
+    }
+
+    rm_handle_t h = malloc_with_cb(size, NULL, tag);
+    if (h == NULL)
+        return NULL;
+
+    // after the allocation, so that the callback can free and compact
+    uint64_t bytes = g_state->tag_bytes[tag], limit = g_state->tag_limits[tag];
+    rm_tag_limit_cb on_limit = g_state->tag_limit_cbs[tag];
+    if (limit != 0 && bytes > limit && on_limit != NULL)
+        on_limit(tag, bytes, g_state->tag_limit_args[tag]);
+    return h;
+}
+
+
+bool rm_tag_usage(uint8_t tag, uint64_t *bytes, uint32_t *handles) {
+    if (tag == 0 || tag >= RM_TAG_COUNT)
+        return false;
+
+    if (bytes != NULL)
+        *bytes = g_state->tag_bytes[tag];
+    if (handles != NULL)
+        *handles = g_state->tag_handles[tag];
+    return true;
+}
+
+
+bool rm_set_tag_limit(uint8_t tag, uint64_t limit, rm_tag_limit_cb on_limit, void *arg) {
+    // function addresses differ between processes
+    if (tag == 0 || tag >= RM_TAG_COUNT || g_state->shared)
+        return false;
+
+    g_state->tag_limits[tag] = limit;
+    g_state->tag_limit_cbs[tag] = on_limit;
+    g_state->tag_limit_args[tag] = arg;
+    return true;
+}
+
+
+static void tag_destroy(void) {
+    if (g_state == NULL || g_state->shared)
+        return;
+
+    free(g_state->tags);
+    g_state->tags = NULL;
+    g_state->tags_count = 0;
+}
+
+#else
+
+static void tag_set(rm_header_t *h, uint8_t tag) {
+    (void)h;
+    (void)tag;
+}
+
+
+static void tag_charge(rm_header_t *h, int64_t delta) {
+    (void)h;
+    (void)delta;
+}
+
+
+static void tag_forget(rm_header_t *h) {
+    (void)h;
+}
+
+
+rm_handle_t rm_malloc_tagged(int size, uint8_t tag) {
+    (void)size;
+    (void)tag;
+    return NULL;
+}
+
+
+bool rm_tag_usage(uint8_t tag, uint64_t *bytes, uint32_t *handles) {
+    (void)tag;
+    (void)bytes;
+    (void)handles;
+    return false;
+}
+
+
+bool rm_set_tag_limit(uint8_t tag, uint64_t limit, rm_tag_limit_cb on_limit, void *arg) {
+    (void)tag;
+    (void)limit;
+    (void)on_limit;
+    (void)arg;
+    return false;
+}
+
+
+static void tag_destroy(void) {
+}
+
+#endif // RMALLOC_TAGS
@@ -0,0 +1,253 @@
+/* compact_trace.c
+ *
+ * binary event tracing of malloc, free, lock, unlock and compaction moves.
+ *
+ * included from compact.c. only compiled in when built with RMALLOC_TRACE=1,
+ * otherwise the TRACE_* macros expand to nothing and rm_trace_start()
+ * returns false.
+ *
+ * each thread writes fixed-size rm_trace_record_t into its own ring buffer,
+ * without taking any locks. a background thread drains all buffers into the
+ * trace file every RM_TRACE_FLUSH_INTERVAL nanoseconds. if a buffer is full,
+ * the record is dropped and counted, the allocator never waits for the disk.
+ *
+ * rm_trace_stop() turns tracing off and then waits for the records being
+ * written, before the last drain. each buffer has a flag that its thread
+ * sets before checking that tracing is still on, so either the thread sees
+ * it off, or the stop sees the flag and waits for the record.
+ *
+ * file format: rm_trace_file_header_t followed by records, in per-thread
+ * order. sort by timestamp to get the global order, see
+ * src/steve/memtrace-to-ops/translate-rmtrace-to-ops.py.
+ */
+
+#if RMALLOC_TRACE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define RM_TRACE_BUFFER_RECORDS 8192 // must be a power of two
+#define RM_TRACE_FLUSH_INTERVAL 1000000
+
+typedef struct trace_buffer_t {
+    rm_trace_record_t records[RM_TRACE_BUFFER_RECORDS];
+    uint64_t head; // only written by the owning thread
+    uint64_t tail; // only written by the flush thread
+    bool writing; // a record is being written, see rm_trace_stop()
+    bool owned; // false once the owning thread has exited, buffer can be reused
+    struct trace_buffer_t *next;
+} trace_buffer_t;
+
+static __thread trace_buffer_t *t_trace_buffer = NULL;
+
+// all buffers, never freed since a thread may hold on to its buffer
+static trace_buffer_t *g_trace_buffers = NULL;
+static pthread_mutex_t g_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_trace_key;
+
+static pthread_t g_trace_thread;
+static FILE *g_trace_fp = NULL;
+static bool g_trace_enabled = false;
+static bool g_trace_stopping = false;
+static uint64_t g_trace_dropped = 0;
+
+
+static void trace_buffer_release(void *buffer) {
+    __atomic_store_n(&((trace_buffer_t *)buffer)->owned, false, __ATOMIC_RELEASE);
+}
+
+
+static void trace_key_create(void) {
+    pthread_key_create(&g_trace_key, trace_buffer_release);
+}
+
+
+static trace_buffer_t *trace_buffer_acquire(void) {
+    pthread_once(&g_trace_key_once, trace_key_create);
+
+    pthread_mutex_lock(&g_trace_mutex);
+
+    trace_buffer_t *b = g_trace_buffers;
+    while (b != NULL && __atomic_load_n(&b->owned, __ATOMIC_ACQUIRE))
+        b = b->next;
+
+    if (b == NULL) {
+        b = (trace_buffer_t *)calloc(1, sizeof(trace_buffer_t));
+        if (b != NULL) {
+            b->next = g_trace_buffers;
+            g_trace_buffers = b;
+        }
+    }
+
+    if (b != NULL) {
+        b->owned = true;
+        pthread_setspecific(g_trace_key, b);
+    }
+
+    pthread_mutex_unlock(&g_trace_mutex);
+
+    t_trace_buffer = b;
+    return b;
+}
+
+
+static void trace_record(uint8_t op, rm_header_t *h, void *old_address, void *new_address, uint32_t size) {
+    if (!__atomic_load_n(&g_trace_enabled, __ATOMIC_RELAXED))
+        return;
+
+    trace_buffer_t *b = t_trace_buffer;
+    if (b == NULL && (b = trace_buffer_acquire()) == NULL)
+        return;
+
+    __atomic_store_n(&b->writing, true, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&g_trace_enabled, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&b->writing, false, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint64_t head = b->head;
+    if (head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) >= RM_TRACE_BUFFER_RECORDS) {
+        __atomic_fetch_add(&g_trace_dropped, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->writing, false, __ATOMIC_RELEASE);
+        return;
+    }
+
+    rm_trace_record_t *r = &b->records[head & (RM_TRACE_BUFFER_RECORDS - 1)];
+    r->timestamp = uptime_nanoseconds();
+    r->handle = (uint64_t)(uintptr_t)h;
+    r->old_address = (uint64_t)(uintptr_t)old_address;
+    r->new_address = (uint64_t)(uintptr_t)new_address;
+    r->size = size;
+    r->op = op;
+
+    __atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&b->writing, false, __ATOMIC_RELEASE);
+}
+
+
+static void trace_drain(void) {
+    pthread_mutex_lock(&g_trace_mutex);
+
+    for (trace_buffer_t *b = g_trace_buffers; b != NULL; b = b->next) {
+        uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = b->tail;
+
+        while (tail != head) {
+            // write up to the end of the ring, then wrap around
+            uint64_t index = tail & (RM_TRACE_BUFFER_RECORDS - 1);
+            uint64_t count = head - tail;
+            if (count > RM_TRACE_BUFFER_RECORDS - index)
+                count = RM_TRACE_BUFFER_RECORDS - index;
+
+            fwrite(&b->records[index], sizeof(rm_trace_record_t), count, g_trace_fp);
+            tail += count;
+        }
+
+        __atomic_store_n(&b->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&g_trace_mutex);
+}
+
+
+static void *trace_thread(void *arg) {
+    (void)arg;
+
+    struct timespec interval = {0, RM_TRACE_FLUSH_INTERVAL};
+    while (!__atomic_load_n(&g_trace_stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        trace_drain();
+    }
+
+    return NULL;
+}
+
+
+bool rm_trace_start(const char *path) {
+    if (g_trace_fp != NULL)
+        return false;
+
+    g_trace_fp = fopen(path, "wb");
+    if (g_trace_fp == NULL)
+        return false;
+
+    rm_trace_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = RM_TRACE_VERSION;
+    header.record_size = sizeof(rm_trace_record_t);
+    fwrite(&header, sizeof(header), 1, g_trace_fp);
+
+    // throw away anything left over from a previous trace
+    pthread_mutex_lock(&g_trace_mutex);
+    for (trace_buffer_t *b = g_trace_buffers; b != NULL; b = b->next)
+        __atomic_store_n(&b->tail, __atomic_load_n(&b->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_trace_mutex);
+
+    g_trace_dropped = 0;
+    g_trace_stopping = false;
+
+    if (pthread_create(&g_trace_thread, NULL, trace_thread, NULL) != 0) {
+        fclose(g_trace_fp);
+        g_trace_fp = NULL;
+        return false;
+    }
+
+    __atomic_store_n(&g_trace_enabled, true, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+void rm_trace_stop(void) {
+    if (g_trace_fp == NULL)
+        return;
+
+    __atomic_store_n(&g_trace_enabled, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_trace_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(g_trace_thread, NULL);
+
+    // threads that saw tracing on are finishing their records
+    pthread_mutex_lock(&g_trace_mutex);
+    for (trace_buffer_t *b = g_trace_buffers; b != NULL; b = b->next) {
+        while (__atomic_load_n(&b->writing, __ATOMIC_SEQ_CST))
+            sched_yield();
+    }
+    pthread_mutex_unlock(&g_trace_mutex);
+
+    trace_drain();
+
+    fclose(g_trace_fp);
+    g_trace_fp = NULL;
+}
+
+
+uint64_t rm_trace_dropped(void) {
+    return __atomic_load_n(&g_trace_dropped, __ATOMIC_RELAXED);
+}
+
+
+#define TRACE(op, h, old_address, new_address, size) trace_record(op, h, old_address, new_address, size)
+
+#else
+
+bool rm_trace_start(const char *path) {
+    (void)path;
+    return false;
+}
+
+
+void rm_trace_stop(void) {
+}
+
+
+uint64_t rm_trace_dropped(void) {
+    return 0;
+}
+
+
+#define TRACE(op, h, old_address, new_address, size)
+
+#endif // RMALLOC_TRACE
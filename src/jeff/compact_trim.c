@@ -0,0 +1,156 @@
+/* compact_trim.c
+ *
+ * two-finger compaction, see rm_compact_trim().
+ *
+ * included from compact.c.
+ *
+ * one finger walks the used blocks down from the top of the heap, the other
+ * the free blocks up from the bottom. the block under the top finger is
+ * copied to the lowest free block below it that it fits in, and the finger
+ * moves on to the next block down. it stops at a locked block, at a block
+ * that fits nowhere below itself, or when maxtime is up, since memory_top
+ * can't get below that block anyway.
+ *
+ * blocks are never moved up, and no block below the last one moved is
+ * touched, so the bytes copied are only those of the blocks above the new
+ * memory_top. the holes that remain are left for rm_compact().
+ *
+ * free blocks are either filled exactly or keep room for their
+ * free_memory_block_t. afterwards the header list is rebuilt from the used
+ * blocks like in compact_parallel.c.
+ *
+ * in concurrent heaps each block is claimed right before it's copied and
+ * released right after, as rm_compact() does, so rm_lock() only ever waits
+ * for the one block being copied. rm_oom_compact() runs this first, from
+ * whichever thread ran out of memory.
+ */
+
+#ifndef __BILLY__
+
+void rm_compact_trim(uint32_t maxtime) {
+    STATS_DECL;
+    STATS_START;
+    STATS_COMPACT_START;
+    uint64_t start_time = uptime_nanoseconds();
+
+    if (heap_concurrent())
+        concurrent_compact_begin();
+    pins_compact_begin();
+
+    rm_header_sort_all();
+
+    uint32_t used_count = 0, free_count = 0;
+    for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+        STATS_COMPACT_VISITED;
+        if (rm_header_is_unused(h))
+            continue;
+        if (h->type == BLOCK_TYPE_FREE)
+            free_count++;
+        else
+            used_count++;
+    }
+
+    rm_header_t **used = (rm_header_t **)malloc(sizeof(rm_header_t *) * (used_count + 1));
+    uintptr_t *free_memory = (uintptr_t *)malloc(sizeof(uintptr_t) * (free_count + 1));
+    uint32_t *free_size = (uint32_t *)malloc(sizeof(uint32_t) * (free_count + 1));
+
+    uint32_t moved = 0;
+    if (used != NULL && free_memory != NULL && free_size != NULL) {
+        used_count = free_count = 0;
+        for (rm_header_t *h = g_state->header_root; h != NULL; h = h->next) {
+            if (rm_header_is_unused(h))
+                continue;
+
+            if (h->type == BLOCK_TYPE_FREE) {
+                // neighbouring free blocks aren't always merged
+                if (free_count > 0 && free_memory[free_count - 1] + free_size[free_count - 1] == (uintptr_t)h->memory) {
+                    free_size[free_count - 1] += h->size;
+                } else {
+                    free_memory[free_count] = (uintptr_t)h->memory;
+                    free_size[free_count++] = h->size;
+                }
+            } else {
+                used[used_count++] = h;
+            }
+        }
+
+        uint32_t first_free = 0; // free blocks below it are used up
+        for (uint32_t i = used_count; i > 0; i--) {
+            rm_header_t *h = used[i - 1];
+            if (h->type != BLOCK_TYPE_UNLOCKED)
+                break;
+            if (maxtime > 0 && uptime_nanoseconds() - start_time >= maxtime)
+                break;
+
+            uint32_t j = first_free;
+            for (; j < free_count && free_memory[j] < (uintptr_t)h->memory; j++) {
+                if (free_size[j] == h->size || free_size[j] >= h->size + sizeof(free_memory_block_t))
+                    break;
+            }
+            if (j == free_count || free_memory[j] >= (uintptr_t)h->memory)
+                break;
+
+            // locked or pinned since the compaction started
+            uint32_t claimed_size;
+            if (heap_concurrent() && concurrent_claim_range(h, h, &claimed_size) == NULL)
+                break;
+
+            void *old_memory = h->memory;
+            TRACE(RM_TRACE_MOVE, h, old_memory, (void *)free_memory[j], h->size);
+            memcpy((void *)free_memory[j], old_memory, h->size);
+            h->memory = (void *)free_memory[j];
+            // still claimed, so that no one sees the new address before
+            // the callback has run
+            block_moved(h, old_memory);
+            if (heap_concurrent())
+                concurrent_release_range(h, h);
+            STATS_COMPACT_MOVED(h->size);
+            moved++;
+
+            free_memory[j] += h->size;
+            free_size[j] -= h->size;
+            while (first_free < free_count && free_size[first_free] == 0)
+                first_free++;
+        }
+    }
+
+    if (moved > 0) {
+        qsort(used, used_count, sizeof(rm_header_t *), copying_compare_address);
+
+        // the old free headers are all replaced
+        for (rm_header_t *h = g_state->header_root; h != NULL; ) {
+            rm_header_t *next = h->next;
+            if (!rm_header_is_unused(h) && h->type == BLOCK_TYPE_FREE)
+                header_set_unused(h);
+            h = next;
+        }
+
+        stitch_used_headers(used, used_count);
+
+        header_trim();
+
+        rebuild_free_block_slots();
+
+        if (g_state->hugepage)
+            hugepage_trim();
+    }
+
+    free(used);
+    free(free_memory);
+    free(free_size);
+
+    pins_compact_end();
+    if (heap_concurrent())
+        concurrent_compact_end();
+
+    STATS_END(RM_STATS_COMPACT);
+    STATS_COMPACT_END(uptime_nanoseconds() - start_time, maxtime);
+}
+
+#else
+
+void rm_compact_trim(uint32_t maxtime) {
+    rm_compact(maxtime);
+}
+
+#endif // __BILLY__
@@ -0,0 +1,202 @@
+/* compact_zone.c
+ *
+ * pinned zone, see rm_set_pinned_zone().
+ *
+ * included from compact.c.
+ *
+ * a handle's score counts its locks (see sample_access()), plus
+ * ZONE_LOCKED_WEIGHT every time rm_compact() finds it locked, which is how
+ * long locks show up without timing them. every rm_compact() halves all
+ * scores afterwards, so only recent behaviour counts. a handle scoring at
+ * least ZONE_HOT is habitually pinned. once in the zone, it's kept there as
+ * long as it scores ZONE_WARM, so that handles hovering around ZONE_HOT
+ * don't move in and out all the time.
+ *
+ * when rm_compact() finds a hot block that is unlocked right now and lies
+ * above zone_top, it compacts by copying instead of sliding (see
+ * copying_run()), with the warm blocks first. they end up at the bottom of
+ * the heap, below the new zone_top, and the rest is compacted above them.
+ * warm blocks that are locked at the time stay where they are, and are
+ * moved by a later rm_compact() if they're outside the zone. sliding never
+ * moves a block up, so the zone stays at the bottom, and the locked blocks
+ * that rm_compact() has to leave in place are mostly down there, instead of
+ * scattered across the heap.
+ *
+ * the scores are one byte per possible header, malloc()'ed, so not in
+ * shared heaps, and a reopened file heap starts with the zone off.
+ */
+
+#define ZONE_LOCKED_WEIGHT 32
+#define ZONE_HOT 48
+#define ZONE_WARM 16
+
+#if RMALLOC_SAMPLING
+
+bool rm_set_pinned_zone(bool on) {
+    if (on == (g_state->lock_scores != NULL))
+        return true;
+    // rm_lock() counts into the scores without the mutex
+    if (heap_concurrent() || g_state->shared)
+        return false;
+
+    if (!on) {
+        free(g_state->lock_scores);
+        g_state->lock_scores = NULL;
+        g_state->lock_scores_count = 0;
+        return true;
+    }
+
+    uint32_t count = g_state->memory_size / sizeof(rm_header_t) + 1;
+    g_state->lock_scores = (uint8_t *)calloc(count, 1);
+    if (g_state->lock_scores == NULL)
+        return false;
+
+    g_state->lock_scores_count = count;
+    g_state->zone_top = g_state->memory_bottom;
+    return true;
+}
+
+
+static uint8_t *zone_score(rm_header_t *h) {
+    uint32_t index = g_state->header_top - h;
+    return index < g_state->lock_scores_count ? &g_state->lock_scores[index] : NULL;
+}
+
+
+static bool zone_is_warm(rm_header_t *h) {
+    uint8_t *score = zone_score(h);
+    return score != NULL && __atomic_load_n(score, __ATOMIC_RELAXED) >= ZONE_WARM;
+}
+
+
+/* a freed handle's index is reused, and shouldn't inherit its heat */
+static void zone_forget(rm_header_t *h) {
+    uint8_t *score = zone_score(h);
+    if (score != NULL)
+        __atomic_store_n(score, 0, __ATOMIC_RELAXED);
+}
+
+
+static void zone_decay(void) {
+    // only handles below header_bottom can have a score. rm_lock() may be
+    // counting at the same time in concurrent heaps, losing a count now and
+    // then doesn't matter.
+    uint32_t count = g_state->header_top - g_state->header_bottom + 1;
+    if (count > g_state->lock_scores_count)
+        count = g_state->lock_scores_count;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t s = __atomic_load_n(&g_state->lock_scores[i], __ATOMIC_RELAXED);
+        if (s != 0)
+            __atomic_store_n(&g_state->lock_scores[i], s >> 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* score the blocks rm_compact() has found locked, and tell whether a hot
+ * block is waiting to be moved into the zone. if not, the scores are
+ * decayed right away, otherwise after the move.
+ */
+static bool zone_update(void) {
+    bool needed = false;
+
+    for (rm_header_t *h = g_state->header_top; h >= g_state->header_bottom; h--) {
+        if (rm_header_is_unused(h) || h->type == BLOCK_TYPE_FREE || h->type == BLOCK_TYPE_ALIAS)
+            continue;
+
+        uint8_t *score = zone_score(h);
+        if (score == NULL)
+            continue;
+
+        uint8_t s = __atomic_load_n(score, __ATOMIC_RELAXED);
+        if (h->type != BLOCK_TYPE_UNLOCKED)
+            __atomic_store_n(score, s > 255 - ZONE_LOCKED_WEIGHT ? 255 : s + ZONE_LOCKED_WEIGHT, __ATOMIC_RELAXED);
+        else if (s >= ZONE_HOT && (uintptr_t)h->memory >= (uintptr_t)g_state->zone_top)
+            needed = true;
+    }
+
+    if (!needed)
+        zone_decay();
+    return needed;
+}
+
+
+/* move the warm blocks in live[] to the front, keeping their order */
+static void zone_order(rm_header_t **live, uint32_t live_count) {
+    rm_header_t **rest = (rm_header_t **)malloc(sizeof(rm_header_t *) * (live_count + 1));
+    if (rest == NULL)
+        return;
+
+    uint32_t warm_count = 0, rest_count = 0;
+    for (uint32_t i = 0; i < live_count; i++) {
+        if (zone_is_warm(live[i]))
+            live[warm_count++] = live[i];
+        else
+            rest[rest_count++] = live[i];
+    }
+    memcpy(live + warm_count, rest, sizeof(rm_header_t *) * rest_count);
+
+    free(rest);
+}
+
+
+/* the zone ends with the last warm block that was moved into it, or that
+ * was already in it and locked. used[] is in address order.
+ */
+static void zone_set_top(rm_header_t **used, uint32_t used_count) {
+    uintptr_t top = (uintptr_t)g_state->memory_bottom;
+    for (uint32_t i = 0; i < used_count; i++) {
+        rm_header_t *h = used[i];
+        if (zone_is_warm(h) && (h->type == BLOCK_TYPE_UNLOCKED || (uintptr_t)h->memory < (uintptr_t)g_state->zone_top))
+            top = (uintptr_t)h->memory + h->size;
+    }
+    g_state->zone_top = (void *)top;
+}
+
+
+static void zone_destroy(void) {
+    if (g_state == NULL || g_state->shared)
+        return;
+
+    free(g_state->lock_scores);
+    g_state->lock_scores = NULL;
+    g_state->lock_scores_count = 0;
+}
+
+#else
+
+bool rm_set_pinned_zone(bool on) {
+    (void)on;
+    return false;
+}
+
+
+static void zone_forget(rm_header_t *h) {
+    (void)h;
+}
+
+
+static void zone_decay(void) {
+}
+
+
+static bool zone_update(void) {
+    return false;
+}
+
+
+static void zone_order(rm_header_t **live, uint32_t live_count) {
+    (void)live;
+    (void)live_count;
+}
+
+
+static void zone_set_top(rm_header_t **used, uint32_t used_count) {
+    (void)used;
+    (void)used_count;
+}
+
+
+static void zone_destroy(void) {
+}
+
+#endif // RMALLOC_SAMPLING
@@ -1,4 +1,9 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "gtest/gtest.h"
 //#include "compact.c" // to get implementation specific details
 #include "compact.h"
@@ -2049,3 +2054,2095 @@ TEST_F(AllocTest, UserFragmentedAllocHeavy) {
     dump_root(groot, 12);
 }
 #endif
+
+#if RMALLOC_STATS
+static void *stats_locker(void *arg) {
+    for (int i=0; i<100000; i++) {
+        rm_lock((rm_handle_t)arg);
+        rm_unlock((rm_handle_t)arg);
+    }
+    return NULL;
+}
+#endif
+
+TEST_F(SmallAllocTest, StatsHistogram) {
+    rm_histogram_t hist;
+
+    ASSERT_EQ(rm_stats_bucket_value(0), 0);
+    ASSERT_EQ(rm_stats_bucket_value(3), 3);
+    ASSERT_EQ(rm_stats_bucket_value(4), 4);
+    ASSERT_EQ(rm_stats_bucket_value(8), 8);
+    ASSERT_EQ(rm_stats_bucket_value(9), 10);
+
+#if RMALLOC_STATS
+    rm_stats_reset();
+
+    rm_handle_t h1 = rm_malloc(1024);
+    rm_handle_t h2 = rm_malloc(1024);
+    rm_lock(h2);
+    rm_unlock(h2);
+    rm_free(h1);
+    rm_compact(0);
+
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_MALLOC, &hist));
+    ASSERT_EQ(hist.count, 2);
+    ASSERT_LE(hist.min, hist.max);
+
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_FREE, &hist));
+    ASSERT_EQ(hist.count, 1);
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_LOCK, &hist));
+    ASSERT_EQ(hist.count, 1);
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_COMPACT, &hist));
+    ASSERT_EQ(hist.count, 1);
+
+    // h2 slid down into the hole left by h1
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_COMPACT_BYTES_MOVED, &hist));
+    ASSERT_EQ(hist.sum, 1024);
+
+    uint64_t total = 0;
+    for (int i=0; i<RM_HISTOGRAM_BUCKETS; i++)
+        total += hist.buckets[i];
+    ASSERT_EQ(total, hist.count);
+
+    // locks from several threads are all counted
+    const int thread_count = 4;
+    pthread_t threads[thread_count];
+    rm_handle_t handles[thread_count];
+    rm_stats_reset();
+    for (int i=0; i<thread_count; i++) {
+        handles[i] = rm_malloc(64);
+        ASSERT_EQ(pthread_create(&threads[i], NULL, stats_locker, handles[i]), 0);
+    }
+    for (int i=0; i<thread_count; i++)
+        pthread_join(threads[i], NULL);
+    ASSERT_TRUE(rm_stats_histogram(RM_STATS_LOCK, &hist));
+    ASSERT_EQ(hist.count, thread_count * 100000);
+    total = 0;
+    for (int i=0; i<RM_HISTOGRAM_BUCKETS; i++)
+        total += hist.buckets[i];
+    ASSERT_EQ(total, hist.count);
+    ASSERT_LE(hist.min, hist.max);
+#else
+    ASSERT_FALSE(rm_stats_histogram(RM_STATS_MALLOC, &hist));
+#endif
+}
+
+TEST_F(SmallAllocTest, TraceRecords) {
+#if RMALLOC_TRACE
+    const char *path = "/tmp/rmalloc-test.rmtrace";
+    ASSERT_TRUE(rm_trace_start(path));
+
+    rm_handle_t h1 = rm_malloc(1024);
+    rm_handle_t h2 = rm_malloc(2048);
+    rm_lock(h2);
+    rm_unlock(h2);
+    rm_free(h1);
+    rm_compact(0);
+
+    rm_trace_stop();
+    ASSERT_EQ(rm_trace_dropped(), 0);
+
+    FILE *fp = fopen(path, "rb");
+    ASSERT_TRUE(fp != NULL);
+
+    rm_trace_file_header_t header;
+    ASSERT_EQ(fread(&header, sizeof(header), 1, fp), 1);
+    ASSERT_EQ(strcmp(header.magic, RM_TRACE_MAGIC), 0);
+    ASSERT_EQ(header.record_size, sizeof(rm_trace_record_t));
+
+    const uint8_t expected[] = {RM_TRACE_MALLOC, RM_TRACE_MALLOC, RM_TRACE_LOCK, RM_TRACE_UNLOCK, RM_TRACE_FREE, RM_TRACE_MOVE};
+    rm_trace_record_t r;
+    int count = 0;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        ASSERT_LT(count, (int)sizeof(expected));
+        ASSERT_EQ(r.op, expected[count]);
+        count++;
+    }
+    fclose(fp);
+    ASSERT_EQ(count, (int)sizeof(expected));
+
+    // the move is h2 sliding down into h1's place
+    ASSERT_EQ(r.handle, (uint64_t)(uintptr_t)h2);
+    ASSERT_EQ(r.new_address, (uint64_t)(uintptr_t)((rm_header_t *)h2)->memory);
+    ASSERT_EQ(r.old_address - r.new_address, 1024);
+#else
+    ASSERT_FALSE(rm_trace_start("/tmp/rmalloc-test.rmtrace"));
+#endif
+}
+
+TEST_F(SmallAllocTest, FileReopen) {
+    const char *path = "/tmp/rmalloc-test.heap";
+    const char *filling = "ABCDEFGHIJKLMNOPQRSTUVXYZ";
+    const int count = 64;
+    uint32_t indices[count];
+
+    unlink(path);
+    ASSERT_TRUE(rm_init_file(path, heap_size_small));
+
+    for (int i=0; i<count; i++) {
+        rm_handle_t h = rm_malloc(100 + i*10);
+        ASSERT_TRUE(h != NULL);
+        indices[i] = rm_handle_index(h);
+        ASSERT_EQ(rm_handle_from_index(indices[i]), h);
+
+        memset(rm_lock(h), filling[i % strlen(filling)], 100 + i*10);
+        rm_unlock(h);
+    }
+    // leave some holes for the free lists
+    for (int i=0; i<count; i+=3)
+        rm_free(rm_handle_from_index(indices[i]));
+
+    // the state is stored in the first page of the mapping
+    void *first_mapping = (void *)((uintptr_t)rm_get_state() & ~(uintptr_t)4095);
+    rm_destroy();
+    ASSERT_TRUE(rm_get_state() == NULL);
+
+    // occupy the old address, so that the heap must be rebased
+    void *blocker = mmap(first_mapping, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT_TRUE(blocker != MAP_FAILED);
+
+    for (int round=0; round<2; round++) {
+        ASSERT_TRUE(rm_init_file(path, 0));
+        g_state = rm_get_state();
+        ASSERT_EQ(g_state->memory_size, heap_size_small);
+        if (round == 0)
+            ASSERT_NE((void *)((uintptr_t)g_state & ~(uintptr_t)4095), first_mapping);
+
+        for (int i=0; i<count; i++) {
+            if (i % 3 == 0)
+                continue;
+
+            rm_handle_t h = rm_handle_from_index(indices[i]);
+            uint8_t *p = (uint8_t *)rm_lock(h);
+            for (int j=0; j<100 + i*10; j++)
+                ASSERT_EQ(p[j], filling[i % strlen(filling)]);
+            rm_unlock(h);
+        }
+
+        // still a working heap
+        rm_handle_t h = rm_malloc(1000);
+        ASSERT_TRUE(h != NULL);
+        rm_free(h);
+        rm_compact(0);
+
+        rm_destroy();
+    }
+
+    munmap(blocker, 4096);
+    unlink(path);
+}
+
+TEST_F(SmallAllocTest, FileReopenAfterLock) {
+    const char *path = "/tmp/rmalloc-test.heap";
+
+    unlink(path);
+    ASSERT_TRUE(rm_init_file(path, heap_size_small));
+    rm_handle_t hole = rm_malloc(1000);
+    rm_handle_t locked = rm_malloc(100);
+    rm_handle_t claimed = rm_malloc(100);
+    memset(rm_lock(locked), 1, 100);
+    memset(rm_lock(claimed), 2, 100);
+    rm_unlock(claimed);
+    uint32_t locked_index = rm_handle_index(locked), claimed_index = rm_handle_index(claimed);
+    rm_free(hole);
+
+    // a crash with one block locked and another being moved, in the middle
+    // of a compaction of a concurrent heap
+    ((rm_header_t *)claimed)->lock_count = RM_LOCK_MOVING;
+#if RMALLOC_CONCURRENT
+    g_state->concurrent = true;
+    pthread_mutex_init(&g_state->mutex, NULL);
+    pthread_mutex_lock(&g_state->mutex);
+#endif
+    rm_destroy();
+
+    ASSERT_TRUE(rm_init_file(path, 0));
+    g_state = rm_get_state();
+    ASSERT_FALSE(g_state->concurrent);
+    locked = rm_handle_from_index(locked_index);
+    claimed = rm_handle_from_index(claimed_index);
+    ASSERT_EQ(((rm_header_t *)locked)->lock_count, 0);
+    ASSERT_EQ(((rm_header_t *)locked)->type, BLOCK_TYPE_UNLOCKED);
+    ASSERT_EQ(((rm_header_t *)claimed)->lock_count, 0);
+
+    // both slide into the hole
+    void *memory = ((rm_header_t *)locked)->memory;
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)locked)->memory, memory);
+    uint8_t *p = (uint8_t *)rm_lock(locked);
+    ASSERT_EQ(p[0], 1);
+    ASSERT_EQ(p[99], 1);
+    rm_unlock(locked);
+    p = (uint8_t *)rm_lock(claimed);
+    ASSERT_EQ(p[0], 2);
+    ASSERT_EQ(p[99], 2);
+    rm_unlock(claimed);
+
+    rm_destroy();
+    unlink(path);
+}
+
+#if RMALLOC_CONCURRENT
+TEST_F(SmallAllocTest, SharedHeapLockAcrossProcesses) {
+    const char *name = "/rmalloc-test";
+
+    shm_unlink(name);
+    ASSERT_TRUE(rm_init_shared(name, heap_size_small));
+
+    rm_handle_t h1 = rm_malloc(1024);
+    rm_handle_t h2 = rm_malloc(1024);
+    memset(rm_lock(h2), 'X', 1024);
+    rm_unlock(h2);
+
+    int to_child[2], to_parent[2];
+    ASSERT_EQ(pipe(to_child), 0);
+    ASSERT_EQ(pipe(to_parent), 0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // attach like an unrelated process would
+        rm_destroy();
+        if (!rm_init_shared(name, 0))
+            _exit(1);
+
+        // the handle is passed as is
+        uint8_t *p = (uint8_t *)rm_lock(h2);
+        for (int i=0; i<1024; i++)
+            if (p[i] != 'X')
+                _exit(2);
+
+        char c = 'L';
+        write(to_parent[1], &c, 1);
+        read(to_child[0], &c, 1);
+
+        // the parent has compacted, but the block is still locked here
+        if (rm_lock(h2) != p || p[0] != 'X')
+            _exit(3);
+        rm_unlock(h2);
+        rm_unlock(h2);
+
+        rm_handle_t h3 = rm_malloc(100);
+        if (h3 == NULL)
+            _exit(4);
+        memset(rm_lock(h3), 'Y', 100);
+        rm_unlock(h3);
+        write(to_parent[1], &h3, sizeof(h3));
+
+        rm_destroy();
+        _exit(0);
+    }
+
+    char c;
+    ASSERT_EQ(read(to_parent[0], &c, 1), 1);
+    ASSERT_EQ(c, 'L');
+
+    // h1 leaves a hole below h2, but h2 is locked by the child
+    void *h2_memory = ((rm_header_t *)h2)->memory;
+    rm_free(h1);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)h2)->memory, h2_memory);
+
+    write(to_child[1], &c, 1);
+
+    rm_handle_t h3;
+    ASSERT_EQ(read(to_parent[0], &h3, sizeof(h3)), sizeof(h3));
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    // now unlocked everywhere, so it may move
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)h2)->memory, h2_memory);
+    uint8_t *p = (uint8_t *)rm_lock(h2);
+    ASSERT_EQ(p[0], 'X');
+    ASSERT_EQ(p[1023], 'X');
+    rm_unlock(h2);
+    ASSERT_EQ(((uint8_t *)rm_lock(h3))[99], 'Y');
+    rm_unlock(h3);
+
+    rm_destroy();
+    shm_unlink(name);
+}
+
+/* the attacher of SharedHeapExecAttach, in a process of its own. does
+ * nothing when run with the other tests.
+ */
+TEST_F(SmallAllocTest, SharedHeapExecAttacher) {
+    const char *name = getenv("RMALLOC_TEST_SHARED");
+    if (name == NULL)
+        return;
+
+    rm_handle_t h = (rm_handle_t)(uintptr_t)strtoull(getenv("RMALLOC_TEST_HANDLE"), NULL, 16);
+    int out = atoi(getenv("RMALLOC_TEST_FD"));
+    ASSERT_TRUE(rm_init_shared(name, 0));
+    uint8_t *p = (uint8_t *)rm_lock(h);
+    ASSERT_EQ(p[0], 'X');
+    ASSERT_EQ(p[1023], 'X');
+    rm_unlock(h);
+
+    rm_handle_t h2 = rm_malloc(100);
+    ASSERT_TRUE(h2 != NULL);
+    memset(rm_lock(h2), 'Y', 100);
+    rm_unlock(h2);
+    ASSERT_EQ(write(out, &h2, sizeof(h2)), (ssize_t)sizeof(h2));
+    rm_destroy();
+}
+
+TEST_F(SmallAllocTest, SharedHeapExecAttach) {
+    const char *name = "/rmalloc-test-exec";
+
+    shm_unlink(name);
+    ASSERT_TRUE(rm_init_shared(name, heap_size_small));
+    rm_handle_t h = rm_malloc(1024);
+    memset(rm_lock(h), 'X', 1024);
+    rm_unlock(h);
+
+    // a new program, with an address space laid out afresh
+    int to_parent[2];
+    ASSERT_EQ(pipe(to_parent), 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char handle[32], fd[16];
+        snprintf(handle, sizeof(handle), "%llx", (unsigned long long)(uintptr_t)h);
+        snprintf(fd, sizeof(fd), "%d", to_parent[1]);
+        setenv("RMALLOC_TEST_SHARED", name, 1);
+        setenv("RMALLOC_TEST_HANDLE", handle, 1);
+        setenv("RMALLOC_TEST_FD", fd, 1);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execl("/proc/self/exe", "run_tests", "--gtest_filter=SmallAllocTest.SharedHeapExecAttacher", (char *)NULL);
+        _exit(127);
+    }
+    close(to_parent[1]);
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    rm_handle_t h2;
+    ASSERT_EQ(read(to_parent[0], &h2, sizeof(h2)), (ssize_t)sizeof(h2));
+    ASSERT_EQ(((uint8_t *)rm_lock(h2))[99], 'Y');
+    rm_unlock(h2);
+    close(to_parent[0]);
+
+    rm_destroy();
+    shm_unlink(name);
+}
+#endif // RMALLOC_CONCURRENT
+
+TEST_F(SmallAllocTest, ArenaReset) {
+    const uint32_t arena_size = KB(64);
+    void *region = malloc(arena_size);
+    rm_handle_t global = rm_malloc(100);
+    rmalloc_meta_t *global_state = rm_get_state();
+
+    rm_arena_t *arena = rm_arena_create(region, arena_size);
+    ASSERT_TRUE(arena != NULL);
+    ASSERT_EQ(rm_get_state(), global_state);
+
+    rm_handle_t first = rm_arena_malloc(arena, 100);
+    void *first_memory = rm_arena_lock(arena, first);
+    ASSERT_TRUE((uint8_t *)first_memory > (uint8_t *)region);
+    ASSERT_TRUE((uint8_t *)first_memory < (uint8_t *)region + arena_size);
+    rm_arena_unlock(arena, first);
+
+    // fill it up
+    int count = 1;
+    while (rm_arena_malloc(arena, 100) != NULL)
+        count++;
+    ASSERT_GT(count, 100);
+
+    // the global heap is untouched
+    ASSERT_EQ(rm_get_state(), global_state);
+    ASSERT_TRUE(rm_malloc(100) != NULL);
+    ASSERT_EQ(((rm_header_t *)global)->size, 100);
+
+    // tables by handle index, which the reset must free
+    rm_set_state(&arena->state);
+    rm_set_pinned_zone(true);
+    rm_group_create(0);
+    rm_set_sampling(1);
+    rm_set_state(global_state);
+
+    // the header below header_top, which the scan for unused headers hands
+    // out with JEFF_MAX_RAM_VS_SLOWER_MALLOC
+    (arena->state.header_top - 1)->memory = first_memory;
+
+    rm_arena_reset(arena);
+    ASSERT_TRUE(arena->state.lock_scores == NULL);
+    ASSERT_TRUE(arena->state.groups == NULL);
+    ASSERT_TRUE(arena->state.samples == NULL);
+    ASSERT_TRUE(rm_header_is_unused(arena->state.header_bottom));
+
+    // all space is back, starting from the bottom
+    rm_handle_t again = rm_arena_malloc(arena, 100);
+    ASSERT_EQ(rm_arena_lock(arena, again), first_memory);
+    rm_arena_unlock(arena, again);
+    int count_again = 1;
+    rm_handle_t h;
+    while ((h = rm_arena_malloc(arena, 100)) != NULL) {
+        if (count_again % 2 == 0)
+            rm_arena_free(arena, h);
+        count_again++;
+    }
+    ASSERT_EQ(count_again, count);
+
+    rm_arena_compact(arena, 0);
+    ASSERT_TRUE(rm_arena_malloc(arena, 100) != NULL);
+
+    free(region);
+}
+
+typedef struct arena_worker_t {
+    void *region;
+    int rounds;
+    int errors;
+} arena_worker_t;
+
+static void *arena_worker(void *arg) {
+    arena_worker_t *w = (arena_worker_t *)arg;
+    const int count = 64;
+    rm_handle_t handles[count];
+
+    rm_arena_t *arena = rm_arena_create(w->region, KB(64));
+    for (int r=0; r<w->rounds; r++) {
+        for (int i=0; i<count; i++) {
+            handles[i] = rm_arena_malloc(arena, 100);
+            if (handles[i] == NULL) {
+                w->errors++;
+                continue;
+            }
+            memset(rm_arena_lock(arena, handles[i]), r + i, 100);
+            rm_arena_unlock(arena, handles[i]);
+        }
+        for (int i=0; i<count; i+=2)
+            rm_arena_free(arena, handles[i]);
+        rm_arena_compact(arena, 0);
+        for (int i=1; i<count; i+=2) {
+            uint8_t *p = (uint8_t *)rm_arena_lock(arena, handles[i]);
+            if ((uint8_t *)p < (uint8_t *)w->region || (uint8_t *)p >= (uint8_t *)w->region + KB(64)
+                || p[0] != (uint8_t)(r + i) || p[99] != (uint8_t)(r + i))
+                w->errors++;
+            rm_arena_unlock(arena, handles[i]);
+        }
+        rm_arena_reset(arena);
+    }
+    return NULL;
+}
+
+TEST_F(SmallAllocTest, ArenasOnThreads) {
+    const int threads = 2, count = 64;
+    pthread_t thread[threads];
+    arena_worker_t workers[threads];
+    rm_handle_t handles[count];
+    rmalloc_meta_t *global_state = rm_get_state();
+
+    for (int t=0; t<threads; t++) {
+        workers[t].region = malloc(KB(64));
+        workers[t].rounds = 2000;
+        workers[t].errors = 0;
+        ASSERT_EQ(pthread_create(&thread[t], NULL, arena_worker, &workers[t]), 0);
+    }
+
+    // the global heap meanwhile, which the arena calls mustn't redirect
+    int errors = 0;
+    for (int r=0; r<500; r++) {
+        for (int i=0; i<count; i++) {
+            handles[i] = rm_malloc(100);
+            if (handles[i] == NULL) {
+                errors++;
+                continue;
+            }
+            uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+            if (p < (uint8_t *)g_state->memory_bottom || p >= (uint8_t *)g_state->memory_top)
+                errors++;
+            memset(p, i, 100);
+            rm_unlock(handles[i]);
+        }
+        for (int i=0; i<count; i++)
+            rm_free(handles[i]);
+        rm_compact(0);
+        if (rm_get_state() != global_state)
+            errors++;
+    }
+
+    for (int t=0; t<threads; t++) {
+        pthread_join(thread[t], NULL);
+        ASSERT_EQ(workers[t].errors, 0);
+        free(workers[t].region);
+    }
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(rm_get_state(), global_state);
+}
+
+
+#if RMALLOC_CONCURRENT
+struct background_worker_t {
+    rm_handle_t *handles;
+    int count;
+    bool *stop;
+    bool pin;
+    int errors;
+};
+
+static void *background_worker(void *arg) {
+    background_worker_t *w = (background_worker_t *)arg;
+    unsigned int seed = (unsigned int)(uintptr_t)w;
+
+    while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+        int i = rand_r(&seed) % w->count;
+        if (w->handles[i] == NULL)
+            continue;
+
+        uint8_t *p = (uint8_t *)(w->pin ? rm_pin(w->handles[i]) : rm_lock(w->handles[i]));
+        for (int j=0; j<1024; j++)
+            if (p[j] != (uint8_t)i)
+                w->errors++;
+        if (w->pin)
+            rm_unpin(w->handles[i]);
+        else
+            rm_unlock(w->handles[i]);
+    }
+
+    return NULL;
+}
+
+TEST_F(SmallAllocTest, BackgroundCompaction) {
+    const int count = 200;
+    rm_handle_t handles[count];
+
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc(1024);
+        memset(rm_lock(handles[i]), i, 1024);
+        rm_unlock(handles[i]);
+    }
+    for (int i=0; i<count; i+=2) {
+        rm_free(handles[i]);
+        handles[i] = NULL;
+    }
+    void *top = g_state->memory_top;
+
+    // held across the whole run, must never move
+    int pinned = count-1;
+    void *pinned_memory = rm_lock(handles[pinned]);
+
+    ASSERT_TRUE(rm_compact_background_start(100000, 0));
+    ASSERT_FALSE(rm_compact_background_start(100000, 0));
+
+    bool stop = false;
+    background_worker_t workers[2];
+    pthread_t threads[2];
+    for (int t=0; t<2; t++) {
+        workers[t].handles = handles;
+        workers[t].count = count;
+        workers[t].stop = &stop;
+        workers[t].pin = t == 1;
+        workers[t].errors = 0;
+        ASSERT_EQ(pthread_create(&threads[t], NULL, background_worker, &workers[t]), 0);
+    }
+
+    // malloc and free alongside the compactor
+    struct timespec ms = {0, 1000000};
+    for (int round=0; round<100; round++) {
+        rm_handle_t h = rm_malloc(512);
+        ASSERT_TRUE(h != NULL);
+        rm_free(h);
+        nanosleep(&ms, NULL);
+    }
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (int t=0; t<2; t++) {
+        pthread_join(threads[t], NULL);
+        ASSERT_EQ(workers[t].errors, 0);
+    }
+    rm_compact_background_stop();
+
+    ASSERT_EQ(rm_lock(handles[pinned]), pinned_memory);
+    rm_unlock(handles[pinned]);
+    rm_unlock(handles[pinned]);
+
+    // compacted below the pinned block
+    ASSERT_EQ(g_state->memory_top, top);
+    for (int i=1; i<count-1; i+=2)
+        ASSERT_LT(((rm_header_t *)handles[i])->memory, pinned_memory);
+    ASSERT_LT(((rm_header_t *)handles[count/2+1])->memory, ((uint8_t *)g_state->memory_bottom) + count/2*1024);
+
+    for (int i=1; i<count; i+=2) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[1023], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+#endif // RMALLOC_CONCURRENT
+
+TEST_F(SmallAllocTest, NestedLocks) {
+    rm_handle_t hole = rm_malloc(1024);
+    rm_handle_t h = rm_malloc(1024);
+    void *memory = rm_lock(h);
+    rm_lock(h);
+    rm_weaklock(h);
+    rm_free(hole);
+
+    // still locked twice
+    rm_unlock(h);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)h)->memory, memory);
+
+    rm_unlock(h);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)h)->memory, memory);
+
+    rm_unlock(h);
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)h)->memory, memory);
+}
+
+#if RMALLOC_CONCURRENT
+struct pin_thread_t {
+    rm_handle_t h;
+    int pipe_in[2];
+    int pipe_out[2];
+};
+
+static void *pin_thread(void *arg) {
+    pin_thread_t *p = (pin_thread_t *)arg;
+    char c = 0;
+
+    rm_pin(p->h);
+    rm_pin(p->h);
+    write(p->pipe_out[1], &c, 1);
+    read(p->pipe_in[0], &c, 1);
+    rm_unpin(p->h);
+    write(p->pipe_out[1], &c, 1);
+    read(p->pipe_in[0], &c, 1);
+    rm_unpin(p->h);
+    write(p->pipe_out[1], &c, 1);
+
+    return NULL;
+}
+
+TEST_F(SmallAllocTest, PinSets) {
+    rm_handle_t hole = rm_malloc(1024);
+    rm_handle_t h = rm_malloc(1024);
+    void *memory = ((rm_header_t *)h)->memory;
+    rm_free(hole);
+
+    pin_thread_t p;
+    p.h = h;
+    ASSERT_EQ(pipe(p.pipe_in), 0);
+    ASSERT_EQ(pipe(p.pipe_out), 0);
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, NULL, pin_thread, &p), 0);
+
+    // pinned by the other thread, twice, without touching the header
+    char c;
+    read(p.pipe_out[0], &c, 1);
+    ASSERT_EQ(((rm_header_t *)h)->lock_count, 0);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)h)->memory, memory);
+    ASSERT_EQ(((rm_header_t *)h)->type, BLOCK_TYPE_UNLOCKED);
+
+    write(p.pipe_in[1], &c, 1);
+    read(p.pipe_out[0], &c, 1);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)h)->memory, memory);
+
+    write(p.pipe_in[1], &c, 1);
+    read(p.pipe_out[0], &c, 1);
+    pthread_join(thread, NULL);
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)h)->memory, memory);
+
+    // more pins than fit in the set spill over into the lock count
+    void *moved = ((rm_header_t *)h)->memory;
+    for (int i=0; i<RM_PIN_SET_SIZE+1; i++)
+        ASSERT_EQ(rm_pin(h), moved);
+    ASSERT_EQ(((rm_header_t *)h)->lock_count, 1);
+    for (int i=0; i<RM_PIN_SET_SIZE+1; i++)
+        rm_unpin(h);
+    ASSERT_EQ(((rm_header_t *)h)->lock_count, 0);
+}
+
+static rm_handle_t g_other_pinned;
+static uint8_t g_other_pinned_type;
+
+static void other_heap_moved(rm_handle_t h, void *old_address, void *new_address) {
+    g_other_pinned_type = ((rm_header_t *)g_other_pinned)->type;
+    (void)h;
+    (void)old_address;
+    (void)new_address;
+}
+
+TEST_F(SmallAllocTest, PinSetsPerHeap) {
+    const uint32_t arena_size = KB(64);
+    void *region = malloc(arena_size);
+    rm_arena_t *arena = rm_arena_create(region, arena_size);
+    ASSERT_TRUE(arena != NULL);
+
+    rm_handle_t arena_hole = rm_arena_malloc(arena, 1024);
+    g_other_pinned = rm_arena_malloc(arena, 1024);
+    void *arena_memory = ((rm_header_t *)g_other_pinned)->memory;
+    rm_arena_free(arena, arena_hole);
+    rmalloc_meta_t *heap = g_state;
+    rm_set_state(&arena->state);
+    rm_pin(g_other_pinned);
+    rm_set_state(heap);
+
+    // compacting this heap leaves the arena's headers alone
+    rm_handle_t hole = rm_malloc(1024);
+    rm_handle_t h = rm_malloc_movable_cb(1024, other_heap_moved);
+    void *memory = ((rm_header_t *)h)->memory;
+    rm_free(hole);
+    g_other_pinned_type = BLOCK_TYPE_FREE;
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)h)->memory, memory);
+    ASSERT_EQ(g_other_pinned_type, BLOCK_TYPE_UNLOCKED);
+
+    // and compacting the arena still sees the pin
+    rm_arena_compact(arena, 0);
+    ASSERT_EQ(((rm_header_t *)g_other_pinned)->memory, arena_memory);
+    rm_set_state(&arena->state);
+    rm_unpin(g_other_pinned);
+    rm_set_state(heap);
+    rm_arena_compact(arena, 0);
+    ASSERT_LT(((rm_header_t *)g_other_pinned)->memory, arena_memory);
+
+    free(region);
+}
+#endif // RMALLOC_CONCURRENT
+
+TEST_F(SmallAllocTest, ParallelCompaction) {
+    const int count = 400;
+    rm_handle_t handles[count];
+    int sizes[count];
+
+    srand(1234);
+    for (int i=0; i<count; i++) {
+        sizes[i] = 64 + rand() % 1024;
+        handles[i] = rm_malloc(sizes[i]);
+        memset(rm_lock(handles[i]), i, sizes[i]);
+        rm_unlock(handles[i]);
+    }
+    for (int i=0; i<count; i++) {
+        if (i % 3 != 0) {
+            rm_free(handles[i]);
+            handles[i] = NULL;
+        }
+    }
+    void *top = g_state->memory_top;
+
+    // segment boundaries
+    int locked[] = {99, 201, 300};
+    void *locked_memory[3];
+    for (int l=0; l<3; l++)
+        locked_memory[l] = rm_lock(handles[locked[l]]);
+
+    rm_compact_parallel(4);
+
+    for (int l=0; l<3; l++) {
+        ASSERT_EQ(((rm_header_t *)handles[locked[l]])->memory, locked_memory[l]);
+        rm_unlock(handles[locked[l]]);
+    }
+    ASSERT_LT(g_state->memory_top, top);
+
+    for (int i=0; i<count; i+=3) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[sizes[i]-1], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+
+    // the heap is still usable, and compacts fully once unlocked
+    rm_handle_t h = rm_malloc(4096);
+    ASSERT_TRUE(h != NULL);
+    rm_free(h);
+    rm_compact_parallel(4);
+    rm_compact(0);
+    for (int i=0; i<count; i+=3) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+
+static pthread_t g_parallel_caller;
+static int g_parallel_moves, g_parallel_elsewhere;
+
+static void parallel_moved(rm_handle_t h, void *old_address, void *new_address) {
+    // not atomic, the callbacks mustn't overlap
+    g_parallel_moves++;
+    if (!pthread_equal(pthread_self(), g_parallel_caller))
+        g_parallel_elsewhere++;
+    ASSERT_EQ(((uint32_t *)new_address)[0], rm_handle_index(h));
+    (void)old_address;
+}
+
+TEST_F(SmallAllocTest, ParallelCompactionCallbacks) {
+    const int count = 400;
+    rm_handle_t handles[count];
+
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc_movable_cb(1024, parallel_moved);
+        *(uint32_t *)rm_lock(handles[i]) = rm_handle_index(handles[i]);
+        rm_unlock(handles[i]);
+    }
+    for (int i=0; i<count; i+=2)
+        rm_free(handles[i]);
+
+    // all on this thread, with every block in place
+    g_parallel_caller = pthread_self();
+    g_parallel_moves = g_parallel_elsewhere = 0;
+    rm_compact_parallel(4);
+    ASSERT_EQ(g_parallel_moves, count / 2);
+    ASSERT_EQ(g_parallel_elsewhere, 0);
+}
+
+TEST_F(SmallAllocTest, HugepageEvacuate) {
+    const int count = 96;
+    const int size = 64*1024;
+    rm_handle_t handles[count];
+
+    ASSERT_TRUE(rm_init_hugepage(MB(7)));
+    g_state = rm_get_state();
+    ASSERT_EQ((uintptr_t)g_state->mapping % RM_HUGEPAGE_SIZE, 0u);
+    ASSERT_EQ(g_state->memory_size, (uint32_t)MB(8));
+
+    // 6 MB, then holes in the lower huge pages and only a few blocks left
+    // in the topmost one
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc(size);
+        ASSERT_TRUE(handles[i] != NULL);
+        memset(rm_lock(handles[i]), i, size);
+        rm_unlock(handles[i]);
+    }
+    uintptr_t cut = ((uintptr_t)g_state->memory_top - 1) & ~(uintptr_t)(RM_HUGEPAGE_SIZE - 1);
+    for (int i=0; i<count; i++) {
+        bool top = (uintptr_t)((rm_header_t *)handles[i])->memory >= cut;
+        if ((top && i % 8 != 0) || (!top && i % 4 == 1)) {
+            rm_free(handles[i]);
+            handles[i] = NULL;
+        }
+    }
+
+    // no time for sliding, the top huge page is emptied anyway
+    rm_compact(1);
+    ASSERT_LE((uintptr_t)g_state->memory_top, cut);
+
+    for (int i=0; i<count; i++) {
+        if (handles[i] == NULL)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_LT((uintptr_t)p, cut);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[size-1], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+
+    // still a working heap
+    rm_handle_t h = rm_malloc(size);
+    ASSERT_TRUE(h != NULL);
+    memset(rm_lock(h), 0xff, size);
+    rm_unlock(h);
+    rm_compact(0);
+
+    rm_destroy();
+    ASSERT_TRUE(g_state->mapping == NULL);
+}
+
+TEST_F(SmallAllocTest, PlacementPolicies) {
+    rm_placement_t policies[] = {RM_PLACEMENT_LOW, RM_PLACEMENT_FIRST_FIT, RM_PLACEMENT_BEST_FIT};
+
+    for (int p=0; p<3; p++) {
+        rm_init(storage, heap_size_small);
+        rm_set_placement(policies[p]);
+
+        // holes of 3000 and 2200 bytes, in the same slot, the larger one lower
+        rm_handle_t large = rm_malloc(3000);
+        rm_handle_t a = rm_malloc(100);
+        rm_handle_t small = rm_malloc(2200);
+        rm_handle_t b = rm_malloc(100);
+        memset(rm_lock(a), 'a', 100);
+        rm_unlock(a);
+        memset(rm_lock(b), 'b', 100);
+        rm_unlock(b);
+        void *large_memory = ((rm_header_t *)large)->memory;
+        void *small_memory = ((rm_header_t *)small)->memory;
+        rm_free(small);
+        rm_free(large);
+        void *top = g_state->memory_top;
+
+        rm_handle_t h = rm_malloc(2000);
+        ASSERT_TRUE(h != NULL);
+        void *expected = policies[p] == RM_PLACEMENT_BEST_FIT ? small_memory : large_memory;
+        ASSERT_EQ(((rm_header_t *)h)->memory, expected);
+        ASSERT_EQ(g_state->memory_top, top);
+
+        memset(rm_lock(h), 'h', 2000);
+        rm_unlock(h);
+        ASSERT_EQ(((uint8_t *)rm_lock(a))[99], 'a');
+        rm_unlock(a);
+        ASSERT_EQ(((uint8_t *)rm_lock(b))[0], 'b');
+        rm_unlock(b);
+    }
+}
+
+typedef struct self_ref_t {
+    struct self_ref_t *self;
+    char *name; // points into data
+    char data[32];
+} self_ref_t;
+
+static int g_move_calls;
+
+static void self_ref_moved(rm_handle_t h, void *old_address, void *new_address) {
+    self_ref_t *s = (self_ref_t *)new_address;
+    g_move_calls++;
+    EXPECT_EQ(((rm_header_t *)h)->memory, new_address);
+    EXPECT_EQ((void *)s->self, old_address);
+    s->name = s->data + (s->name - (char *)old_address - offsetof(self_ref_t, data));
+    s->self = s;
+}
+
+TEST_F(SmallAllocTest, RelocationCallback) {
+    rm_handle_t hole = rm_malloc(4096);
+    rm_handle_t h = rm_malloc_movable_cb(sizeof(self_ref_t), self_ref_moved);
+    rm_handle_t plain = rm_malloc(64);
+    ASSERT_TRUE(h != NULL);
+
+    self_ref_t *s = (self_ref_t *)rm_lock(h);
+    strcpy(s->data, "self");
+    s->name = s->data;
+    s->self = s;
+    void *before = s;
+    rm_unlock(h);
+    rm_free(hole);
+
+    g_move_calls = 0;
+    rm_compact(0);
+    ASSERT_EQ(g_move_calls, 1);
+
+    s = (self_ref_t *)rm_lock(h);
+    ASSERT_LT((void *)s, before);
+    ASSERT_EQ(s->self, s);
+    ASSERT_STREQ(s->name, "self");
+    rm_unlock(h);
+
+    // the same callback shares a slot, plain blocks have none
+    rm_handle_t h2 = rm_malloc_movable_cb(64, self_ref_moved);
+    ASSERT_EQ(((rm_header_t *)h2)->move_cb, ((rm_header_t *)h)->move_cb);
+    ASSERT_EQ(((rm_header_t *)plain)->move_cb, 0);
+}
+
+TEST_F(SmallAllocTest, CopyingCompaction) {
+    const int count = 300;
+    rm_handle_t handles[count];
+    int sizes[count];
+
+    for (int i=0; i<count; i++) {
+        sizes[i] = 32 + (i*37) % 2000;
+        handles[i] = rm_malloc(sizes[i]);
+        memset(rm_lock(handles[i]), i, sizes[i]);
+        rm_unlock(handles[i]);
+    }
+    // most of it dies
+    for (int i=0; i<count; i++) {
+        if (i % 5 != 0) {
+            rm_free(handles[i]);
+            handles[i] = NULL;
+        }
+    }
+    void *top = g_state->memory_top;
+    int island = 150;
+    void *island_memory = rm_lock(handles[island]);
+
+    ASSERT_TRUE(rm_compact_copying());
+
+    ASSERT_EQ(((rm_header_t *)handles[island])->memory, island_memory);
+    rm_unlock(handles[island]);
+    ASSERT_LT(g_state->memory_top, top);
+
+    // packed in handle order below the island
+    for (int i=5; i<island; i+=5)
+        ASSERT_EQ(((rm_header_t *)handles[i])->memory,
+                  (uint8_t *)((rm_header_t *)handles[i-5])->memory + ((rm_header_t *)handles[i-5])->size);
+
+    for (int i=0; i<count; i+=5) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[sizes[i]-1], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+
+    // the free space is usable, and the sliding compactor agrees
+    rm_handle_t h = rm_malloc(10000);
+    ASSERT_TRUE(h != NULL);
+    rm_free(h);
+    rm_compact(0);
+    for (int i=0; i<count; i+=5) {
+        ASSERT_EQ(((uint8_t *)rm_lock(handles[i]))[0], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+
+/* the rest of the heap in 16-byte blocks, each filled with its number,
+ * leaving room for a few headers
+ */
+static int fill_heap(rm_handle_t *fill, int max) {
+    int count = 0;
+    while (count < max && (uint8_t *)g_state->header_bottom - (uint8_t *)g_state->memory_top > 200 &&
+           (fill[count] = rm_malloc(16)) != NULL) {
+        memset(rm_lock(fill[count]), count, 16);
+        rm_unlock(fill[count]);
+        count++;
+    }
+    return count;
+}
+
+static void assert_filled(rm_handle_t *fill, int count) {
+    for (int i=0; i<count; i++) {
+        uint8_t *p = (uint8_t *)rm_lock(fill[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[15], (uint8_t)i);
+        rm_unlock(fill[i]);
+    }
+}
+
+/* a nearly full 64 KB heap with a locked block, 'island', above a hole that
+ * 'big' doesn't fit in. 'last' takes most of the hole, and is last in handle
+ * order. with a group, the hole starts with a member of it, and big is
+ * another one.
+ */
+typedef struct islands_t {
+    rm_handle_t island, big, last;
+    void *island_memory;
+    void *top;
+    rm_handle_t fill[4096];
+    int count;
+} islands_t;
+
+static void islands_build(islands_t *t, rm_group_t group) {
+    rm_handle_t first = group != 0 ? rm_group_malloc(group, 200) : NULL;
+    rm_handle_t a = rm_malloc(group != 0 ? 800 : 1000);
+    t->island = rm_malloc(16);
+    t->island_memory = rm_lock(t->island);
+    t->big = group != 0 ? rm_group_malloc(group, 1008) : rm_malloc(1008);
+    memset(rm_lock(t->big), 'b', 1008);
+    rm_unlock(t->big);
+    t->count = fill_heap(t->fill, 4096);
+
+    rm_free(a);
+    rm_set_placement(RM_PLACEMENT_LOW);
+    t->last = rm_malloc(group != 0 ? 700 : 900);
+    ASSERT_TRUE(first == NULL || ((rm_header_t *)first)->memory == g_state->memory_bottom);
+    ASSERT_TRUE(t->last != NULL);
+    memset(rm_lock(t->last), 'l', 700);
+    rm_unlock(t->last);
+    t->top = g_state->memory_top;
+}
+
+/* no higher than before, with everything intact */
+static void islands_check(islands_t *t) {
+    ASSERT_LE(g_state->memory_top, t->top);
+    ASSERT_EQ(((rm_header_t *)t->island)->memory, t->island_memory);
+    rm_unlock(t->island);
+
+    ASSERT_EQ(((uint8_t *)rm_lock(t->big))[1007], 'b');
+    rm_unlock(t->big);
+    ASSERT_EQ(((uint8_t *)rm_lock(t->last))[699], 'l');
+    rm_unlock(t->last);
+    assert_filled(t->fill, t->count);
+}
+
+TEST_F(SmallAllocTest, CopyingAroundIslands) {
+    static islands_t t;
+    rm_init(storage, KB(64));
+    islands_build(&t, 0);
+
+    // not in handle order, big would leave the hole empty
+    ASSERT_TRUE(rm_compact_copying());
+    islands_check(&t);
+}
+
+#if RMALLOC_SAMPLING
+TEST_F(SmallAllocTest, LocalityCompaction) {
+    const int count = 64;
+    rm_handle_t handles[count];
+
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc(256);
+        memset(rm_lock(handles[i]), i, 256);
+        rm_unlock(handles[i]);
+    }
+
+    // used together: 50, 3, 40, far apart in memory
+    rm_set_sampling(1);
+    int together[] = {50, 3, 40};
+    for (int round=0; round<10; round++) {
+        for (int t=0; t<3; t++) {
+            rm_lock(handles[together[t]]);
+            rm_unlock(handles[together[t]]);
+        }
+    }
+    rm_set_sampling(0);
+
+    ASSERT_TRUE(rm_compact_locality());
+
+    uint8_t *bottom = (uint8_t *)g_state->memory_bottom;
+    for (int t=0; t<3; t++)
+        ASSERT_EQ(((rm_header_t *)handles[together[t]])->memory, bottom + t*256);
+    ASSERT_EQ(g_state->sample_next, 0u);
+
+    for (int i=0; i<count; i++) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[255], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+#endif // RMALLOC_SAMPLING
+
+TEST_F(SmallAllocTest, LocalityAroundIslands) {
+    static islands_t t;
+    rm_init(storage, KB(64));
+    islands_build(&t, 0);
+
+    rm_set_sampling(1);
+    rm_lock(t.big);
+    rm_unlock(t.big);
+    rm_set_sampling(0);
+
+    // big first would leave the hole below the island empty
+    ASSERT_TRUE(rm_compact_locality());
+    islands_check(&t);
+}
+
+#if RMALLOC_SAMPLING
+TEST_F(SmallAllocTest, PinnedZone) {
+    const int count = 64;
+    rm_handle_t handles[count];
+
+    ASSERT_TRUE(rm_set_pinned_zone(true));
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc(256);
+        memset(rm_lock(handles[i]), i, 256);
+        rm_unlock(handles[i]);
+    }
+    for (int i=0; i<count; i+=2) {
+        rm_free(handles[i]);
+        handles[i] = NULL;
+    }
+
+    // 41 stays locked over two compactions, 51 is locked often
+    uint8_t *bottom = (uint8_t *)g_state->memory_bottom;
+    rm_lock(handles[41]);
+    rm_compact(0);
+    rm_compact(0);
+    ASSERT_NE(((rm_header_t *)handles[41])->memory, bottom);
+    rm_unlock(handles[41]);
+    for (int i=0; i<100; i++) {
+        rm_lock(handles[51]);
+        rm_unlock(handles[51]);
+    }
+
+    // both at the bottom, in address order
+    rm_compact(0);
+    uint8_t *zone_41 = (uint8_t *)((rm_header_t *)handles[41])->memory;
+    uint8_t *zone_51 = (uint8_t *)((rm_header_t *)handles[51])->memory;
+    ASSERT_TRUE(zone_41 == bottom || zone_51 == bottom);
+    ASSERT_TRUE(zone_41 == bottom + 256 || zone_51 == bottom + 256);
+    ASSERT_EQ(g_state->zone_top, bottom + 2*256);
+
+    for (int i=1; i<count; i+=2) {
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[255], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+#endif // RMALLOC_SAMPLING
+
+#if RMALLOC_SAMPLING && RMALLOC_CONCURRENT
+TEST_F(SmallAllocTest, PinnedZoneConcurrent) {
+    rm_handle_t h = rm_malloc(100);
+
+    // lockers count into the scores without the mutex, so they stay
+    ASSERT_TRUE(rm_set_pinned_zone(true));
+    ASSERT_TRUE(rm_compact_background_start(UINT32_MAX, 0));
+    ASSERT_FALSE(rm_set_pinned_zone(false));
+    ASSERT_TRUE(rm_set_pinned_zone(true));
+    uint8_t *scores = g_state->lock_scores;
+    ASSERT_TRUE(scores != NULL);
+    rm_lock(h);
+    rm_unlock(h);
+    rm_compact_background_stop();
+
+    ASSERT_TRUE(rm_set_pinned_zone(false));
+    ASSERT_TRUE(g_state->lock_scores == NULL);
+    ASSERT_TRUE(rm_compact_background_start(UINT32_MAX, 0));
+    ASSERT_FALSE(rm_set_pinned_zone(true));
+    ASSERT_TRUE(rm_set_pinned_zone(false));
+    rm_compact_background_stop();
+}
+#endif // RMALLOC_SAMPLING && RMALLOC_CONCURRENT
+
+#if RMALLOC_SAMPLING
+TEST_F(SmallAllocTest, PinnedZoneAroundIslands) {
+    static islands_t t;
+    rm_init(storage, KB(64));
+    ASSERT_TRUE(rm_set_pinned_zone(true));
+    islands_build(&t, 0);
+
+    for (int i=0; i<100; i++) {
+        rm_lock(t.big);
+        rm_unlock(t.big);
+    }
+
+    // hot big first would leave the hole below the island empty
+    rm_compact(0);
+    islands_check(&t);
+}
+#endif // RMALLOC_SAMPLING
+
+TEST_F(SmallAllocTest, TrimCompaction) {
+    const int count = 32;
+    rm_handle_t handles[count];
+
+    for (int i=0; i<count; i++) {
+        handles[i] = rm_malloc(256);
+        memset(rm_lock(handles[i]), i, 256);
+        rm_unlock(handles[i]);
+    }
+
+    // eight holes, all in the bottom half
+    for (int i=0; i<16; i+=2) {
+        rm_free(handles[i]);
+        handles[i] = NULL;
+    }
+
+    // the topmost block is locked, nothing moves
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+    uint8_t *memory_1 = (uint8_t *)((rm_header_t *)handles[1])->memory;
+    rm_lock(handles[count-1]);
+    rm_compact_trim(0);
+    ASSERT_EQ(g_state->memory_top, top);
+    rm_unlock(handles[count-1]);
+
+    // the eight topmost fill the holes, the rest stay put
+    rm_compact_trim(0);
+    ASSERT_EQ(g_state->memory_top, top - 8*256);
+    ASSERT_EQ(((rm_header_t *)handles[1])->memory, memory_1);
+    ASSERT_EQ(((rm_header_t *)handles[count-1])->memory, memory_1 - 256);
+
+    for (int i=0; i<count; i++) {
+        if (handles[i] == NULL)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[255], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+
+    rm_handle_t h = rm_malloc(1024);
+    ASSERT_NE(h, (rm_handle_t)NULL);
+}
+
+#if RMALLOC_CONCURRENT
+static rm_handle_t g_trim_handles[32];
+static int g_trim_claimed, g_trim_moves, g_trim_moves_claimed;
+
+static void trim_moved(rm_handle_t h, void *old_address, void *new_address) {
+    for (int i=0; i<32; i++) {
+        if (g_trim_handles[i] != NULL && g_trim_handles[i] != h
+            && ((rm_header_t *)g_trim_handles[i])->lock_count == RM_LOCK_MOVING)
+            g_trim_claimed++;
+    }
+    g_trim_moves++;
+    if (((rm_header_t *)h)->lock_count == RM_LOCK_MOVING)
+        g_trim_moves_claimed++;
+    (void)old_address;
+    (void)new_address;
+}
+
+TEST_F(SmallAllocTest, TrimCompactionClaimsOneBlock) {
+    const int count = 32;
+
+    for (int i=0; i<count; i++)
+        g_trim_handles[i] = rm_malloc_movable_cb(256, trim_moved);
+    for (int i=0; i<16; i+=2) {
+        rm_free(g_trim_handles[i]);
+        g_trim_handles[i] = NULL;
+    }
+
+    // every move sees no block but its own claimed, which is released after
+    // the callback, and leaves none behind
+    ASSERT_TRUE(rm_compact_background_start(UINT32_MAX, 0));
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+    g_trim_claimed = g_trim_moves = g_trim_moves_claimed = 0;
+    rm_compact_trim(0);
+    rm_compact_background_stop();
+    ASSERT_EQ(g_state->memory_top, top - 8*256);
+    ASSERT_EQ(g_trim_claimed, 0);
+    ASSERT_GT(g_trim_moves, 0);
+    ASSERT_EQ(g_trim_moves_claimed, g_trim_moves);
+    for (int i=0; i<count; i++) {
+        if (g_trim_handles[i] != NULL)
+            ASSERT_EQ(((rm_header_t *)g_trim_handles[i])->lock_count, 0);
+    }
+}
+#endif // RMALLOC_CONCURRENT
+
+static int g_oom_calls = 0;
+static rm_handle_t g_oom_cache = NULL;
+
+static bool drop_cache(int size, void *arg) {
+    g_oom_calls++;
+    if (g_oom_cache != NULL) {
+        rm_free(g_oom_cache);
+        g_oom_cache = NULL;
+    }
+    return rm_oom_compact(size, arg);
+}
+
+TEST_F(SmallAllocTest, OomHandler) {
+    const int count = 1024;
+    rm_handle_t handles[count];
+    int allocated = 0;
+
+    // fill the heap, then punch holes of 2 KB
+    for (; allocated<count; allocated++) {
+        handles[allocated] = rm_malloc(2048);
+        if (handles[allocated] == NULL)
+            break;
+        memset(rm_lock(handles[allocated]), allocated, 2048);
+        rm_unlock(handles[allocated]);
+    }
+    ASSERT_LT(allocated, count);
+    for (int i=0; i<allocated; i+=2) {
+        rm_free(handles[i]);
+        handles[i] = NULL;
+    }
+
+    // fits in total, but not in one piece
+    ASSERT_EQ(rm_malloc(64*1024), (rm_handle_t)NULL);
+
+    // too large to ever fit, compaction isn't even tried
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+    ASSERT_TRUE(rm_set_oom_handler(rm_oom_compact, NULL));
+    ASSERT_EQ(rm_malloc(heap_size_small), (rm_handle_t)NULL);
+    ASSERT_EQ(g_state->memory_top, top);
+
+    rm_handle_t h = rm_malloc(64*1024);
+    ASSERT_NE(h, (rm_handle_t)NULL);
+
+    // a handler of its own, that drops a cached block first
+    g_oom_cache = handles[1];
+    handles[1] = NULL;
+    uint32_t maxtime = 0;
+    ASSERT_TRUE(rm_set_oom_handler(drop_cache, &maxtime));
+    while (rm_malloc(2048) != NULL)
+        ;
+    ASSERT_GE(g_oom_calls, 1);
+    ASSERT_EQ(g_oom_cache, (rm_handle_t)NULL);
+
+    for (int i=0; i<allocated; i++) {
+        if (handles[i] == NULL)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[2047], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+
+    ASSERT_TRUE(rm_set_oom_handler(NULL, NULL));
+}
+
+TEST_F(SmallAllocTest, Reserve) {
+    const int count = 1024;
+    rm_handle_t handles[count];
+    int allocated = 0;
+
+    for (; allocated<count; allocated++) {
+        handles[allocated] = rm_malloc(2048);
+        if (handles[allocated] == NULL)
+            break;
+        memset(rm_lock(handles[allocated]), allocated, 2048);
+        rm_unlock(handles[allocated]);
+    }
+    for (int i=0; i<allocated; i+=2) {
+        rm_free(handles[i]);
+        handles[i] = NULL;
+    }
+    ASSERT_EQ(rm_malloc(16*1024), (rm_handle_t)NULL);
+
+    // the holes fit exactly, nothing is moved
+    void *second = ((rm_header_t *)handles[1])->memory;
+    ASSERT_TRUE(rm_reserve(2048, 0));
+    ASSERT_EQ(((rm_header_t *)handles[1])->memory, second);
+
+    ASSERT_FALSE(rm_reserve(heap_size_small, 0));
+
+    // stops long before the top
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+    void *last = ((rm_header_t *)handles[allocated-1])->memory;
+    ASSERT_TRUE(rm_reserve(16*1024, 0));
+    ASSERT_EQ(((rm_header_t *)handles[allocated-1])->memory, last);
+    ASSERT_EQ(g_state->memory_top, top);
+
+    ASSERT_TRUE(rm_reserve(16*1024, 0));
+    ASSERT_NE(rm_malloc(16*1024), (rm_handle_t)NULL);
+
+    for (int i=0; i<allocated; i++) {
+        if (handles[i] == NULL)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(handles[i]);
+        ASSERT_EQ(p[0], (uint8_t)i);
+        ASSERT_EQ(p[2047], (uint8_t)i);
+        rm_unlock(handles[i]);
+    }
+}
+
+#if RMALLOC_GROUPS
+TEST_F(SmallAllocTest, Groups) {
+    const int count = 64;
+    rm_handle_t a[count], b[count], loose[count];
+
+    rm_group_t group_a = rm_group_create(1024);
+    rm_group_t group_b = rm_group_create(1024);
+    ASSERT_NE(group_a, (rm_group_t)0);
+    ASSERT_NE(group_b, (rm_group_t)0);
+    ASSERT_NE(group_a, group_b);
+
+    // interleaved, as two documents being loaded at the same time
+    for (int i=0; i<count; i++) {
+        a[i] = rm_group_malloc(group_a, 64);
+        b[i] = rm_group_malloc(group_b, 64);
+        loose[i] = rm_malloc(64);
+        ASSERT_NE(a[i], (rm_handle_t)NULL);
+        ASSERT_NE(b[i], (rm_handle_t)NULL);
+        ASSERT_NE(loose[i], (rm_handle_t)NULL);
+        memset(rm_lock(a[i]), 'a' + i % 16, 64);
+        memset(rm_lock(b[i]), 'A' + i % 16, 64);
+        rm_unlock(a[i]);
+        rm_unlock(b[i]);
+    }
+
+    // sixteen to a chunk, one after the other
+    for (int i=1; i<count; i++) {
+        if (i % 16 == 0)
+            continue;
+        ASSERT_EQ((uint8_t *)rm_lock(a[i]), (uint8_t *)rm_lock(a[i-1]) + 64);
+        rm_unlock(a[i]);
+        rm_unlock(a[i-1]);
+    }
+
+    for (int i=0; i<count; i++)
+        rm_free(loose[i]);
+    rm_free(a[5]);
+    a[5] = rm_malloc(64);
+
+    // all of group a in one run
+    rm_compact_copying();
+    uint8_t *lowest = (uint8_t *)rm_lock(a[0]);
+    rm_unlock(a[0]);
+    for (int i=0; i<count; i++) {
+        if (i == 5)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(a[i]);
+        ASSERT_EQ(p[0], (uint8_t)('a' + i % 16));
+        if (p < lowest)
+            lowest = p;
+        rm_unlock(a[i]);
+    }
+    for (int i=0; i<count; i++) {
+        if (i == 5)
+            continue;
+        uint8_t *p = (uint8_t *)rm_lock(a[i]);
+        ASSERT_LT(p, lowest + (count - 1) * 64);
+        rm_unlock(a[i]);
+    }
+
+    int used = g_state->header_used_count;
+    rm_group_free(group_a);
+    ASSERT_EQ(g_state->header_used_count, used - (count - 1)); // the last one took the chunk's rest
+    ASSERT_EQ(rm_group_malloc(group_a, 64), (rm_handle_t)NULL);
+
+    // a[5] isn't in the group anymore
+    ASSERT_EQ(((rm_header_t *)a[5])->type, BLOCK_TYPE_UNLOCKED);
+    for (int i=0; i<count; i++) {
+        uint8_t *p = (uint8_t *)rm_lock(b[i]);
+        ASSERT_EQ(p[63], (uint8_t)('A' + i % 16));
+        rm_unlock(b[i]);
+    }
+
+    rm_compact(0);
+    rm_group_free(group_b);
+    ASSERT_EQ(g_state->header_used_count, 1);
+}
+#endif // RMALLOC_GROUPS
+
+static void fill_text(uint8_t *p, int size, int seed) {
+    int n = 0;
+    for (int line=0; n < size; line++) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "<p class=\"item\">document %d, line %d</p>\n", seed, line);
+        for (int i=0; i<len && n < size; i++)
+            p[n++] = buf[i];
+    }
+}
+
+static void text_moved(rm_handle_t h, void *old_address, void *new_address) {
+    (void)h, (void)old_address, (void)new_address;
+}
+
+
+#if RMALLOC_GROUPS
+TEST_F(SmallAllocTest, GroupsAroundIslands) {
+    static islands_t t;
+    rm_init(storage, KB(64));
+    rm_group_t group = rm_group_create(16);
+    ASSERT_NE(group, (rm_group_t)0);
+    islands_build(&t, group);
+
+    // gathering big with the first member would leave the hole below the
+    // island empty
+    ASSERT_TRUE(rm_compact_copying());
+    islands_check(&t);
+}
+#endif // RMALLOC_GROUPS
+
+#if RMALLOC_COMPRESS
+TEST_F(SmallAllocTest, Compression) {
+    const int count = 64, size = 4096;
+    rm_handle_t text[count], noise[4];
+    uint8_t expected[size];
+
+    ASSERT_TRUE(rm_set_compression(1));
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i);
+        rm_unlock(text[i]);
+    }
+    rm_handle_t movable = rm_malloc_movable_cb(size, text_moved);
+    fill_text((uint8_t *)rm_lock(movable), size, count);
+    rm_unlock(movable);
+    srand(42);
+    for (int i=0; i<4; i++) {
+        noise[i] = rm_malloc(size);
+        uint8_t *p = (uint8_t *)rm_lock(noise[i]);
+        for (int j=0; j<size; j++)
+            p[j] = rand();
+        rm_unlock(noise[i]);
+    }
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+
+    // one round isn't cold enough, and the one locked in between never is
+    rm_compact(0);
+    ASSERT_EQ((uint8_t *)g_state->memory_top, top);
+    rm_lock(text[0]);
+    rm_unlock(text[0]);
+    rm_compact(0);
+
+    ASSERT_EQ(((rm_header_t *)text[0])->size, (uint32_t)size);
+    for (int i=1; i<count; i++)
+        ASSERT_LT(((rm_header_t *)text[i])->size, (uint32_t)size / 4);
+    for (int i=0; i<4; i++)
+        ASSERT_EQ(((rm_header_t *)noise[i])->size, (uint32_t)size);
+    ASSERT_EQ(((rm_header_t *)movable)->size, (uint32_t)size);
+    ASSERT_LT((uint8_t *)g_state->memory_top, top - (count / 2) * size);
+
+    for (int i=1; i<count; i+=2) {
+        fill_text(expected, size, i);
+        uint8_t *p = (uint8_t *)(i % 4 == 1 ? rm_lock(text[i]) : rm_pin(text[i]));
+        ASSERT_EQ(((rm_header_t *)text[i])->size, (uint32_t)size);
+        ASSERT_EQ(memcmp(p, expected, size), 0);
+        if (i % 4 == 1)
+            rm_unlock(text[i]);
+        else
+            rm_unpin(text[i]);
+    }
+    rm_free(text[2]);
+
+    // decompresses everything, the background thread can't
+#if RMALLOC_CONCURRENT
+    ASSERT_TRUE(rm_compact_background_start(1000, 0));
+    rm_compact_background_stop();
+#else
+    ASSERT_TRUE(rm_set_compression(0));
+#endif
+    ASSERT_EQ(g_state->compress_ages, (uint8_t *)NULL);
+    for (int i=0; i<count; i++) {
+        if (i == 2)
+            continue;
+        fill_text(expected, size, i);
+        ASSERT_EQ(((rm_header_t *)text[i])->size, (uint32_t)size);
+        ASSERT_EQ(memcmp(rm_lock(text[i]), expected, size), 0);
+        rm_unlock(text[i]);
+    }
+}
+#endif // RMALLOC_COMPRESS
+
+#if RMALLOC_COMPRESS
+TEST_F(SmallAllocTest, CompressionPinned) {
+    const int count = 8, size = 4096;
+    rm_handle_t text[count];
+    uint8_t expected[size];
+
+    ASSERT_TRUE(rm_set_compression(1));
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i);
+        rm_unlock(text[i]);
+    }
+    fill_text(expected, size, 1);
+    uint8_t *pinned = (uint8_t *)rm_pin(text[1]);
+    rm_compact(0);
+    rm_compact(0);
+    rm_compact(0);
+
+    ASSERT_LT(((rm_header_t *)text[2])->size, (uint32_t)size / 4);
+    ASSERT_EQ(((rm_header_t *)text[1])->size, (uint32_t)size);
+    ASSERT_EQ(((rm_header_t *)text[1])->memory, pinned);
+    ASSERT_EQ(memcmp(pinned, expected, size), 0);
+
+    // cold again only after as many calls as any other block
+    rm_unpin(text[1]);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)text[1])->size, (uint32_t)size);
+    rm_compact(0);
+    ASSERT_LT(((rm_header_t *)text[1])->size, (uint32_t)size / 4);
+    ASSERT_TRUE(rm_set_compression(0));
+}
+#endif // RMALLOC_COMPRESS
+
+#if RMALLOC_COMPRESS
+TEST_F(SmallAllocTest, CompressionBudget) {
+    const int count = 8, size = 4096;
+    rm_handle_t text[count];
+
+    ASSERT_TRUE(rm_set_compression(1));
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i);
+        rm_unlock(text[i]);
+    }
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+    rm_compact(0);
+
+    // all are cold, but the time is up after the first
+    rm_compact(1);
+    int compressed = 0;
+    for (int i=0; i<count; i++)
+        compressed += ((rm_header_t *)text[i])->size < (uint32_t)size;
+    ASSERT_EQ(compressed, 1);
+    ASSERT_EQ((uint8_t *)g_state->memory_top, top);
+
+    // the rest are left for the next call
+    rm_compact(0);
+    for (int i=0; i<count; i++)
+        ASSERT_LT(((rm_header_t *)text[i])->size, (uint32_t)size / 4);
+    ASSERT_TRUE(rm_set_compression(0));
+}
+#endif // RMALLOC_COMPRESS
+
+#if RMALLOC_COMPRESS
+TEST_F(SmallAllocTest, Spill) {
+    const int count = 64, size = 4096;
+    rm_handle_t text[count];
+    uint8_t expected[size];
+
+    ASSERT_TRUE(rm_set_spill("/tmp/rmalloc-spill-test", 1));
+    ASSERT_FALSE(rm_set_spill("/tmp/rmalloc-spill-test", 1));
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i);
+        rm_unlock(text[i]);
+    }
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+
+    rm_compact(0);
+    rm_lock(text[0]);
+    rm_unlock(text[0]);
+    rm_compact(0);
+
+    // only stubs are left
+    ASSERT_EQ(((rm_header_t *)text[0])->size, (uint32_t)size);
+    for (int i=1; i<count; i++)
+        ASSERT_EQ(((rm_header_t *)text[i])->size, sizeof(free_memory_block_t));
+    ASSERT_LT((uint8_t *)g_state->memory_top, top - (count - 2) * size);
+    ASSERT_EQ(g_state->spill_end, (uint64_t)(count - 1) * size);
+
+    for (int i=1; i<count; i+=2) {
+        rm_prefetch(text[i]);
+        fill_text(expected, size, i);
+        ASSERT_EQ(memcmp(rm_lock(text[i]), expected, size), 0);
+        ASSERT_EQ(((rm_header_t *)text[i])->size, (uint32_t)size);
+        rm_unlock(text[i]);
+    }
+    rm_free(text[2]);
+    text[2] = NULL;
+
+    // spilled compressed, and the holes are reused
+    ASSERT_TRUE(rm_set_compression(1));
+    rm_compact(0);
+    rm_compact(0);
+    for (int i=1; i<count; i+=2)
+        ASSERT_EQ(((rm_header_t *)text[i])->size, sizeof(free_memory_block_t));
+    ASSERT_LT(g_state->spill_end, (uint64_t)(count - 1) * size);
+
+    ASSERT_TRUE(rm_set_spill(NULL, 0));
+    ASSERT_EQ(g_state->spill_fd, -1);
+    ASSERT_TRUE(rm_set_compression(0));
+    ASSERT_EQ(g_state->compress_ages, (uint8_t *)NULL);
+    for (int i=0; i<count; i++) {
+        if (text[i] == NULL)
+            continue;
+        fill_text(expected, size, i);
+        ASSERT_EQ(((rm_header_t *)text[i])->size, (uint32_t)size);
+        ASSERT_EQ(memcmp(rm_lock(text[i]), expected, size), 0);
+        rm_unlock(text[i]);
+    }
+}
+#endif // RMALLOC_COMPRESS
+
+#if RMALLOC_COMPRESS
+TEST_F(SmallAllocTest, SpillPinned) {
+    const int count = 8, size = 4096;
+    rm_handle_t text[count];
+    uint8_t expected[size];
+
+    ASSERT_TRUE(rm_set_spill("/tmp/rmalloc-spill-test", 1));
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i);
+        rm_unlock(text[i]);
+    }
+    fill_text(expected, size, 1);
+    uint8_t *pinned = (uint8_t *)rm_pin(text[1]);
+    rm_compact(0);
+    rm_compact(0);
+    rm_compact(0);
+
+    ASSERT_EQ(((rm_header_t *)text[2])->size, sizeof(free_memory_block_t));
+    ASSERT_EQ(((rm_header_t *)text[1])->size, (uint32_t)size);
+    ASSERT_EQ(((rm_header_t *)text[1])->memory, pinned);
+    ASSERT_EQ(memcmp(pinned, expected, size), 0);
+    ASSERT_EQ(g_state->spill_end, (uint64_t)(count - 1) * size);
+    rm_unpin(text[1]);
+
+    ASSERT_TRUE(rm_set_spill(NULL, 0));
+    for (int i=0; i<count; i++) {
+        fill_text(expected, size, i);
+        ASSERT_EQ(memcmp(rm_lock(text[i]), expected, size), 0);
+        rm_unlock(text[i]);
+    }
+}
+#endif // RMALLOC_COMPRESS
+
+#if RMALLOC_DEDUP
+TEST_F(SmallAllocTest, Dedup) {
+    const int count = 48, kinds = 3, size = 1000;
+    rm_handle_t text[count];
+    uint8_t expected[size];
+
+    // nothing to unlink
+    rm_free(NULL);
+
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, i % kinds);
+        rm_unlock(text[i]);
+        ASSERT_TRUE(rm_mark_immutable(text[i]));
+    }
+    rm_handle_t unmarked = rm_malloc(size);
+    fill_text((uint8_t *)rm_lock(unmarked), size, 0);
+    rm_unlock(unmarked);
+    ASSERT_FALSE(rm_mark_immutable(rm_malloc_movable_cb(size, text_moved)));
+    uint8_t *top = (uint8_t *)g_state->memory_top;
+
+    // locked ones are left for later
+    void *locked = rm_lock(text[kinds]);
+    rm_compact(0);
+    ASSERT_EQ(rm_lock(text[kinds]), locked);
+    rm_unlock(text[kinds]);
+    rm_unlock(text[kinds]);
+    ASSERT_EQ(((rm_header_t *)text[kinds])->type, BLOCK_TYPE_UNLOCKED);
+    ASSERT_EQ(((rm_header_t *)unmarked)->type, BLOCK_TYPE_UNLOCKED);
+    ASSERT_LT((uint8_t *)g_state->memory_top, top - (count - kinds - 2) * size);
+
+    rm_compact(0);
+    for (int i=0; i<count; i++) {
+        ASSERT_EQ(((rm_header_t *)text[i])->type, BLOCK_TYPE_ALIAS);
+        fill_text(expected, size, i % kinds);
+        uint8_t *p = (uint8_t *)rm_lock(text[i]);
+        ASSERT_EQ(memcmp(p, expected, size), 0);
+        ASSERT_EQ(p, rm_lock(text[i % kinds]));
+        rm_unlock(text[i % kinds]);
+        rm_unlock(text[i]);
+    }
+
+    // the copy goes with the last handle
+    top = (uint8_t *)g_state->memory_top;
+    for (int i=1; i<count; i+=kinds)
+        rm_free(text[i]);
+    rm_compact(0);
+    ASSERT_LE((uint8_t *)g_state->memory_top, top - size);
+    fill_text(expected, size, 2);
+    ASSERT_EQ(memcmp(rm_lock(text[count - 1]), expected, size), 0);
+    rm_unlock(text[count - 1]);
+}
+#endif // RMALLOC_DEDUP
+
+#if RMALLOC_DEDUP
+TEST_F(SmallAllocTest, DedupPinned) {
+    const int count = 8, size = 1000;
+    rm_handle_t text[count];
+    uint8_t expected[size];
+
+    for (int i=0; i<count; i++) {
+        text[i] = rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(text[i]), size, 0);
+        rm_unlock(text[i]);
+        ASSERT_TRUE(rm_mark_immutable(text[i]));
+    }
+    // the time is up after hashing the first
+    rm_compact(1);
+    for (int i=0; i<count; i++)
+        ASSERT_NE(((rm_header_t *)text[i])->type, BLOCK_TYPE_ALIAS);
+
+    // the others are collapsed and compacted over its old place
+    fill_text(expected, size, 0);
+    uint8_t *pinned = (uint8_t *)rm_pin(text[1]);
+    rm_compact(0);
+    rm_compact(0);
+    ASSERT_NE(((rm_header_t *)text[1])->type, BLOCK_TYPE_ALIAS);
+    ASSERT_EQ(((rm_header_t *)text[1])->memory, pinned);
+    ASSERT_EQ(memcmp(pinned, expected, size), 0);
+    ASSERT_EQ(((rm_header_t *)text[2])->type, BLOCK_TYPE_ALIAS);
+
+    // and it joins them once unpinned
+    rm_unpin(text[1]);
+    rm_compact(0);
+    ASSERT_EQ(((rm_header_t *)text[1])->type, BLOCK_TYPE_ALIAS);
+    ASSERT_EQ(memcmp(rm_lock(text[1]), expected, size), 0);
+    rm_unlock(text[1]);
+}
+#endif // RMALLOC_DEDUP
+
+TEST_F(SmallAllocTest, HeaderReuse) {
+    const int count = 200, size = 64;
+    rm_handle_t h[count];
+
+    for (int i=0; i<count; i++)
+        h[i] = rm_malloc(size);
+    rm_header_t *bottom = g_state->header_bottom;
+
+    // the freed headers are reused, the table doesn't grow
+    for (int i=1; i<count; i+=2)
+        rm_free(h[i]);
+    rm_compact(0);
+    ASSERT_GE(g_state->header_bottom, bottom);
+    for (int i=1; i<count; i+=2)
+        h[i] = rm_malloc(size);
+    ASSERT_GE(g_state->header_bottom, bottom);
+
+    // top first
+    for (int i=count / 2; i<count; i++)
+        rm_free(h[i]);
+    rm_compact(0);
+    uint32_t lowest = 0;
+    while (!rm_header_is_unused(rm_handle_from_index(lowest)))
+        lowest++;
+    ASSERT_LT(lowest, rm_handle_index(h[count - 1]));
+    h[count / 2] = rm_malloc(size);
+    ASSERT_EQ(rm_handle_index(h[count / 2]), lowest);
+    ASSERT_EQ(rm_trim_headers(), 0u);
+
+    // freed at the bottom. rm_free() leaves the headers in use until
+    // rm_compact(), which gives them back, and leaves nothing to trim
+    for (int i=count / 2 + 1; i<count; i++)
+        h[i] = rm_malloc(size);
+    ASSERT_EQ((rm_header_t *)h[count - 1], g_state->header_bottom);
+    for (int i=count / 2 + 1; i<count; i++)
+        rm_free(h[i]);
+    ASSERT_EQ(rm_trim_headers(), 0u);
+    bottom = g_state->header_bottom;
+    rm_compact(0);
+    ASSERT_GE(g_state->header_bottom - bottom, count / 2 - 1);
+    ASSERT_GE(g_state->header_bottom, g_state->header_top - (count / 2 + 1));
+    ASSERT_EQ(rm_trim_headers(), 0u);
+}
+
+#if RMALLOC_GENERATIONS
+TEST_F(SmallAllocTest, IndexHandles) {
+    ASSERT_EQ(rm_index(NULL), 0u);
+    ASSERT_EQ(rm_index_handle(0), (rm_handle_t)NULL);
+    ASSERT_EQ(rm_index_lock(0), (void *)NULL);
+
+    rm_handle_t h = rm_malloc(64);
+    rm_index_t i = rm_index(h);
+    ASSERT_EQ(i & ((1u << RM_INDEX_BITS) - 1), rm_handle_index(h) + 1);
+    ASSERT_EQ(rm_index_handle(i), h);
+    ASSERT_EQ(rm_index_lock(i), ((rm_header_t *)h)->memory);
+    rm_index_unlock(i);
+    ASSERT_EQ(((rm_header_t *)h)->lock_count, 0);
+
+    // freed, and then reused for another block
+    rm_free(h);
+    ASSERT_EQ(rm_index_handle(i), (rm_handle_t)NULL);
+    rm_compact(0);
+    rm_handle_t h2 = rm_malloc(64);
+    ASSERT_EQ(h2, h);
+    ASSERT_EQ(rm_index_lock(i), (void *)NULL);
+    rm_index_t i2 = rm_index(h2);
+    ASSERT_NE(i2, i);
+    ASSERT_EQ(rm_index_lock(i2), ((rm_header_t *)h2)->memory);
+    rm_unlock(h2);
+
+    // out of range
+    ASSERT_EQ(rm_index_handle(i2 + (1u << 20)), (rm_handle_t)NULL);
+}
+#endif // RMALLOC_GENERATIONS
+
+TEST_F(SmallAllocTest, Features) {
+    // whatever is compiled in, the core works
+    rm_handle_t h = rm_malloc(64);
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(rm_lock(h), ((rm_header_t *)h)->memory);
+    rm_unlock(h);
+    ASSERT_EQ(((rm_header_t *)h)->type, BLOCK_TYPE_UNLOCKED);
+
+    // and what isn't says so
+    ASSERT_EQ(rm_compact_background_start(100000, 0), (bool)RMALLOC_CONCURRENT);
+    rm_compact_background_stop();
+    ASSERT_EQ(rm_set_pinned_zone(true), (bool)RMALLOC_SAMPLING);
+    rm_set_pinned_zone(false);
+    ASSERT_EQ(rm_group_create(1024) != 0, (bool)RMALLOC_GROUPS);
+    ASSERT_EQ(rm_set_compression(1), (bool)RMALLOC_COMPRESS);
+    rm_set_compression(0);
+    ASSERT_EQ(rm_mark_immutable(h), (bool)RMALLOC_DEDUP);
+
+    rm_index_t i = rm_index(h);
+    rm_free(h);
+    rm_compact(0);
+    ASSERT_EQ(rm_malloc(64), h);
+    ASSERT_EQ(rm_index_handle(i) == NULL, (bool)RMALLOC_GENERATIONS);
+    ASSERT_EQ(rm_malloc_tagged(64, 1) != NULL, (bool)RMALLOC_TAGS);
+}
+
+#if RMALLOC_TAGS
+static uint64_t tag_bytes_counted(rm_handle_t *h, int count) {
+    uint64_t bytes = 0;
+    for (int i=0; i<count; i++) {
+        if (h[i] != NULL && ((rm_header_t *)h[i])->type != BLOCK_TYPE_ALIAS)
+            bytes += ((rm_header_t *)h[i])->size;
+    }
+    return bytes;
+}
+
+static int g_tag_limit_calls;
+static uint64_t g_tag_limit_bytes;
+
+static void tag_limit_reached(uint8_t tag, uint64_t bytes, void *arg) {
+    g_tag_limit_calls++;
+    g_tag_limit_bytes = bytes;
+    // shed the oldest block
+    rm_handle_t *cache = (rm_handle_t *)arg;
+    rm_free(*cache);
+    *cache = NULL;
+    (void)tag;
+}
+
+TEST_F(SmallAllocTest, Tags) {
+    const int count = 32, size = 4096;
+    rm_handle_t h[count];
+    uint64_t bytes;
+    uint32_t handles;
+
+    ASSERT_EQ(rm_malloc_tagged(64, 0), (rm_handle_t)NULL);
+    ASSERT_EQ(rm_malloc_tagged(64, RM_TAG_COUNT), (rm_handle_t)NULL);
+    ASSERT_FALSE(rm_tag_usage(0, &bytes, &handles));
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(bytes, 0u);
+    ASSERT_EQ(handles, 0u);
+
+    // every other block is text, tagged 1, with untagged blocks in between
+    ASSERT_TRUE(rm_set_compression(1));
+    for (int i=0; i<count; i++) {
+        h[i] = i % 2 == 0 ? rm_malloc_tagged(size, 1) : rm_malloc(size);
+        fill_text((uint8_t *)rm_lock(h[i]), size, i);
+        rm_unlock(h[i]);
+    }
+    rm_handle_t other = rm_malloc_tagged(100, 2);
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(bytes, (uint64_t)(count / 2) * size);
+    ASSERT_EQ(handles, (uint32_t)(count / 2));
+    ASSERT_TRUE(rm_tag_usage(2, &bytes, &handles));
+    ASSERT_EQ(bytes, (uint64_t)((rm_header_t *)other)->size);
+    ASSERT_EQ(handles, 1u);
+
+    // freed, then compressed by rm_compact()
+    rm_free(h[0]);
+    h[0] = NULL;
+    rm_compact(0);
+    rm_compact(0);
+    rm_handle_t tagged[count / 2];
+    for (int i=0; i<count / 2; i++)
+        tagged[i] = h[2 * i];
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(handles, (uint32_t)(count / 2 - 1));
+    ASSERT_LT(bytes, (uint64_t)(count / 2 - 1) * size / 4);
+    ASSERT_EQ(bytes, tag_bytes_counted(tagged, count / 2));
+
+    // locking brings one back
+    rm_lock(h[2]);
+    rm_unlock(h[2]);
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(bytes, tag_bytes_counted(tagged, count / 2));
+    ASSERT_TRUE(rm_set_compression(0));
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(bytes, (uint64_t)(count / 2 - 1) * size);
+
+    // copies shared by rm_compact() belong to none of them
+    rm_handle_t same[2];
+    for (int i=0; i<2; i++) {
+        same[i] = rm_malloc_tagged(size, 3);
+        fill_text((uint8_t *)rm_lock(same[i]), size, 0);
+        rm_unlock(same[i]);
+        ASSERT_TRUE(rm_mark_immutable(same[i]));
+    }
+    rm_compact(0);
+    ASSERT_TRUE(rm_tag_usage(3, &bytes, &handles));
+    ASSERT_EQ(bytes, 0u);
+    ASSERT_EQ(handles, 2u);
+    rm_free(same[0]);
+    rm_free(same[1]);
+    ASSERT_TRUE(rm_tag_usage(3, &bytes, &handles));
+    ASSERT_EQ(handles, 0u);
+
+    for (int i=0; i<count; i++)
+        rm_free(h[i]);
+    ASSERT_TRUE(rm_tag_usage(1, &bytes, &handles));
+    ASSERT_EQ(bytes, 0u);
+    ASSERT_EQ(handles, 0u);
+
+    // over the limit after the second block, which sheds the first
+    rm_handle_t cache = NULL;
+    ASSERT_FALSE(rm_set_tag_limit(0, 1000, tag_limit_reached, &cache));
+    ASSERT_TRUE(rm_set_tag_limit(4, 1000, tag_limit_reached, &cache));
+    g_tag_limit_calls = 0;
+    cache = rm_malloc_tagged(600, 4);
+    ASSERT_EQ(g_tag_limit_calls, 0);
+    rm_handle_t kept = rm_malloc_tagged(600, 4);
+    ASSERT_EQ(g_tag_limit_calls, 1);
+    ASSERT_GT(g_tag_limit_bytes, 1000u);
+    ASSERT_EQ(cache, (rm_handle_t)NULL);
+    ASSERT_TRUE(rm_tag_usage(4, &bytes, &handles));
+    ASSERT_EQ(bytes, (uint64_t)((rm_header_t *)kept)->size);
+    ASSERT_EQ(handles, 1u);
+}
+#endif // RMALLOC_TAGS
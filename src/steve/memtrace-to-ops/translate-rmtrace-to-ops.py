@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+"""
+translate-rmtrace-to-ops.py -- convert a binary rmalloc trace to an ops file.
+
+Usage::
+
+    translate-rmtrace-to-ops.py app.rmtrace
+
+Writes app.rmtrace-ops, which can be replayed by the drivers in src/steve.
+
+The trace is written by compact.c built with RMALLOC_TRACE=1, see
+rm_trace_start() in jeff/compact.h. It starts with a header:
+
+    char magic[8] ("RMTRACE"), uint32 version, uint32 record_size
+
+followed by fixed-size little-endian records:
+
+    uint64 timestamp, uint64 handle, uint64 old_address, uint64 new_address,
+    uint32 size, uint8 op, uint8 reserved[3]
+
+Records are in per-thread order, so they are sorted on timestamp first.
+
+Header addresses are reused after free, so each N starts a new handle
+number. Addresses are written relative to the lowest address seen, to fit in
+the 32-bit fields the drivers read. Moves (R) are specific to the allocator
+that made the trace and are not written.
+
+Each lock (L) is written as an access (A), which the drivers replay as a
+lock immediately followed by an unlock, and unlocks (U) are not written.
+The drivers turn L ops into accesses anyway, so how long a block stayed
+locked is lost, and locked blocks don't pin the heap during replay.
+"""
+
+import struct
+import sys
+
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<QQQQIB3x')
+
+
+def read_records(filename):
+    fp = open(filename, 'rb')
+    magic, version, record_size = HEADER.unpack(fp.read(HEADER.size))
+    if magic.rstrip(b'\0') != b'RMTRACE' or version != 1 or record_size != RECORD.size:
+        raise ValueError("%s: not an rmalloc trace (version 1)" % filename)
+
+    records = []
+    data = fp.read(RECORD.size)
+    while len(data) == RECORD.size:
+        records.append(RECORD.unpack(data))
+        data = fp.read(RECORD.size)
+    fp.close()
+
+    records.sort(key=lambda r: r[0])
+    return records
+
+
+def translate(records, out):
+    addresses = [r[2] for r in records if r[2]] + [r[3] for r in records if r[3]]
+    base = min(addresses) if addresses else 0
+
+    handles = {}
+    next_handle = 0
+    skipped = 0
+    for timestamp, handle, old_address, new_address, size, op in records:
+        op = chr(op)
+        if op == 'N':
+            handles[handle] = next_handle
+            next_handle += 1
+            out.write("%d N %d %d\n" % (handles[handle], new_address - base, size))
+        elif op in ['L', 'F']:
+            if handle not in handles:
+                # allocated before the trace started
+                skipped += 1
+                continue
+
+            if op == 'F':
+                out.write("%d F %d 0\n" % (handles[handle], old_address - base))
+                del handles[handle]
+            else:
+                out.write("%d A %d %d\n" % (handles[handle], new_address - base, size))
+
+    return next_handle, skipped
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s app.rmtrace\n" % sys.argv[0])
+        sys.exit(1)
+
+    records = read_records(sys.argv[1])
+    out = open(sys.argv[1] + '-ops', 'w')
+    handle_count, skipped = translate(records, out)
+    out.close()
+
+    sys.stderr.write("%d records, %d handles, %d ops on handles allocated before the trace started\n"
+                     % (len(records), handle_count, skipped))
+
+
+if __name__ == '__main__':
+    main()